@@ -1,5 +1,17 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
 #include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 
 // Ŀ¼ҵе .cpp ļ
@@ -13,42 +25,262 @@ std::vector<std::string> find_cpp_files(const std::string& directory) {
     return cpp_files;
 }
 
-// ļ
-void backup_files(const std::vector<std::string>& files, const std::string& source_directory, const std::string& backup_directory) {
-    std::filesystem::create_directories(backup_directory);
-    for (const auto& file : files) {
-        // ȡļԴĿ¼·
-        std::filesystem::path relative_path = std::filesystem::relative(file, source_directory);
+// ļݵĹϣ(FNV-1a 64λ)ȡʧܷ0
+uint64_t hash_file(const std::filesystem::path& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        return 0;
+    }
+    uint64_t hash = 14695981039346656037ull;
+    char buffer[64 * 1024];
+    while (file.read(buffer, sizeof(buffer)) || file.gcount() > 0) {
+        std::streamsize count = file.gcount();
+        for (std::streamsize i = 0; i < count; i++) {
+            hash ^= static_cast<unsigned char>(buffer[i]);
+            hash *= 1099511628211ull;
+        }
+    }
+    return hash;
+}
 
-        // ڱĿ¼дͬ·
-        std::filesystem::path backup_path = backup_directory / relative_path;
+// ϴͬʱԴļĴС޸ʱ
+struct SourceState {
+    uintmax_t size = 0;
+    long long time = 0;
+    bool valid = false;
 
-        // ļĿ¼
-        std::filesystem::create_directories(backup_path.parent_path());
+    bool operator==(const SourceState& other) const {
+        return valid && other.valid && size == other.size && time == other.time;
+    }
+};
 
-        // ļ
-        std::filesystem::copy(file, backup_path, std::filesystem::copy_options::overwrite_existing);
+// ¼Դļ״̬ļĿĿ¼Уÿ: ·\tС\t޸ʱ
+const char* sync_state_filename = ".copy_and_update_time.state";
 
-        // ñļ޸ʱΪǰʱ
-        std::filesystem::last_write_time(backup_path, std::filesystem::file_time_type::clock::now());
+// ȡϴͬ¼Դļ״̬ · -> ״̬
+std::unordered_map<std::string, SourceState> read_sync_state(const std::filesystem::path& destination_directory) {
+    std::unordered_map<std::string, SourceState> states;
+    std::ifstream file(destination_directory / sync_state_filename, std::ios::binary);
+    std::string line;
+    while (std::getline(file, line)) {
+        std::vector<std::string> fields;
+        std::istringstream iss(line);
+        std::string field;
+        while (std::getline(iss, field, '\t')) {
+            fields.push_back(field);
+        }
+        if (fields.size() < 3) {
+            continue;
+        }
+        SourceState& state = states[fields[0]];
+        state.size = std::strtoull(fields[1].c_str(), nullptr, 10);
+        state.time = std::strtoll(fields[2].c_str(), nullptr, 10);
+        state.valid = true;
+    }
+    return states;
+}
+
+// д뱾ͬԴļ״̬дʱļ滻жʱдһļ¼
+void write_sync_state(const std::filesystem::path& destination_directory, const std::vector<std::string>& relative_paths, const std::vector<SourceState>& states) {
+    std::filesystem::path state_path = destination_directory / sync_state_filename;
+    std::filesystem::path temp_path = state_path;
+    temp_path += ".tmp";
+    {
+        std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+        for (size_t i = 0; i < relative_paths.size(); i++) {
+            if (states[i].valid) {
+                file << relative_paths[i] << '\t' << states[i].size << '\t' << states[i].time << '\n';
+            }
+        }
+        if (!file) {
+            return;
+        }
+    }
+    std::error_code ec;
+    std::filesystem::rename(temp_path, state_path, ec);
+}
+
+// ȡԴļǰĴС޸ʱ
+SourceState get_source_state(const std::filesystem::path& src_path) {
+    SourceState state;
+    std::error_code ec;
+    state.size = std::filesystem::file_size(src_path, ec);
+    if (ec) {
+        return state;
+    }
+    auto time = std::filesystem::last_write_time(src_path, ec);
+    if (ec) {
+        return state;
+    }
+    state.time = static_cast<long long>(time.time_since_epoch().count());
+    state.valid = true;
+    return state;
+}
+
+// жĿļǷҪ
+// ԴļĴС޸ʱϴͬʱ¼ֱͬСֱͬӸƣȽݹϣ
+// Ŀļ޸ʱȽϣƺĿļʱǱΪǰʱ
+bool need_copy(const std::filesystem::path& src_path, const std::filesystem::path& dst_path, const SourceState& src_state, const SourceState* recorded_state) {
+    std::error_code ec;
+    uintmax_t dst_size = std::filesystem::file_size(dst_path, ec);
+    if (ec || !src_state.valid) {
+        return true;
+    }
+    if (dst_size != src_state.size) {
+        return true;
+    }
+    if (recorded_state != nullptr && *recorded_state == src_state) {
+        return false;
+    }
+    return hash_file(src_path) != hash_file(dst_path);
+}
+
+// ͬͳ
+struct SyncStats {
+    std::atomic<size_t> copied_files{0};
+    std::atomic<uintmax_t> copied_bytes{0};
+    std::atomic<size_t> skipped_files{0};
+    std::atomic<uintmax_t> skipped_bytes{0};
+    std::atomic<size_t> deleted_files{0};
+    std::atomic<size_t> failed_files{0};
+};
+
+// ͬļֻб仯ļֻЩļ޸ʱ䣬ֻ±Ķļ
+void sync_files(const std::vector<std::string>& files, const std::string& source_directory, const std::string& destination_directory, unsigned int jobs, SyncStats& stats) {
+    std::filesystem::create_directories(destination_directory);
+
+    std::unordered_map<std::string, SourceState> recorded_states = read_sync_state(destination_directory);
+    std::vector<std::string> relative_paths(files.size());
+    std::vector<SourceState> source_states(files.size());
+
+    std::mutex print_mutex;
+    std::atomic<size_t> next_index{0};
+    auto worker = [&]() {
+        for (size_t index = next_index++; index < files.size(); index = next_index++) {
+            const std::string& file = files[index];
+
+            // ȡļԴĿ¼·
+            std::filesystem::path relative_path = std::filesystem::relative(file, source_directory);
+
+            // ĿĿ¼дͬ·
+            std::filesystem::path destination_path = destination_directory / relative_path;
+
+            relative_paths[index] = relative_path.generic_string();
+            SourceState source_state = get_source_state(file);
+            uintmax_t file_size = source_state.size;
+            auto recorded_it = recorded_states.find(relative_paths[index]);
+            const SourceState* recorded_state = recorded_it != recorded_states.end() ? &recorded_it->second : nullptr;
+
+            std::error_code ec;
+            if (!need_copy(file, destination_path, source_state, recorded_state)) {
+                source_states[index] = source_state;
+                stats.skipped_files++;
+                stats.skipped_bytes += file_size;
+                continue;
+            }
+
+            // ĿļĿ¼
+            std::filesystem::create_directories(destination_path.parent_path(), ec);
+
+            // ļɱ׼ѡƽ̨ĸƷʽ
+            std::filesystem::copy_file(file, destination_path, std::filesystem::copy_options::overwrite_existing, ec);
+            if (!ec) {
+                // ֻиƹļ޸ʱΪǰʱ
+                std::filesystem::last_write_time(destination_path, std::filesystem::file_time_type::clock::now(), ec);
+            }
+            if (ec) {
+                stats.failed_files++;
+                std::lock_guard<std::mutex> lock(print_mutex);
+                std::cout << "copy failed: " << file << " " << ec.message() << "\n";
+                continue;
+            }
+
+            // ʧܵļ¼״̬´¼
+            source_states[index] = source_state;
+            stats.copied_files++;
+            stats.copied_bytes += file_size;
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned int i = 0; i < jobs; i++) {
+        threads.emplace_back(worker);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    write_sync_state(destination_directory, relative_paths, source_states);
+}
+
+// ɾĿĿ¼ԴĿ¼Ѿڵ .cpp ļ
+void delete_stale_files(const std::vector<std::string>& files, const std::string& source_directory, const std::string& destination_directory, SyncStats& stats) {
+    std::unordered_set<std::string> source_relative_paths;
+    for (const auto& file : files) {
+        source_relative_paths.insert(std::filesystem::relative(file, source_directory).generic_string());
+    }
+
+    for (const auto& file : find_cpp_files(destination_directory)) {
+        std::string relative_path = std::filesystem::relative(file, destination_directory).generic_string();
+        if (source_relative_paths.count(relative_path) > 0) {
+            continue;
+        }
+        std::error_code ec;
+        if (std::filesystem::remove(file, ec)) {
+            stats.deleted_files++;
+        } else {
+            stats.failed_files++;
+            std::cout << "delete failed: " << file << " " << ec.message() << "\n";
+        }
     }
 }
 
 
 int main(int argc, char* argv[]) {
-    if (argc != 3) {
-        std::cout << "Usage: program source_folder destination_folder\n";
+    if (argc < 3) {
+        std::cout << "Usage: program source_folder destination_folder [--delete] [--jobs N]\n";
         return 1;
     }
 
     std::filesystem::path src_folder = argv[1];
     std::filesystem::path dst_folder = argv[2];
 
+    // ѡ
+    bool delete_stale = false;
+    unsigned int jobs = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 3; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--delete") {
+            delete_stale = true;
+        } else if (arg == "--jobs" && i + 1 < argc) {
+            jobs = std::max(1, std::atoi(argv[++i]));
+        } else {
+            std::cout << "Unknown option: " << arg << "\n";
+            return 1;
+        }
+    }
+
     // ҵе .cpp ļ
     std::vector<std::string> cpp_files = find_cpp_files(argv[1]);
 
-    //  .cpp ļ
-    backup_files(cpp_files, argv[1],argv[2]);
+    // ͬ .cpp ļ
+    SyncStats stats;
+    sync_files(cpp_files, argv[1], argv[2], jobs, stats);
+
+    // ɾԴĿ¼Ѿڵļ
+    if (delete_stale && std::filesystem::is_directory(dst_folder)) {
+        delete_stale_files(cpp_files, argv[1], argv[2], stats);
+    }
+
+    std::cout << "copied: " << stats.copied_files << " files, " << stats.copied_bytes << " bytes\n";
+    std::cout << "skipped: " << stats.skipped_files << " files, " << stats.skipped_bytes << " bytes\n";
+    if (delete_stale) {
+        std::cout << "deleted: " << stats.deleted_files << " files\n";
+    }
+    if (stats.failed_files > 0) {
+        std::cout << "failed: " << stats.failed_files << " files\n";
+        return 1;
+    }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -1,17 +1,34 @@
 #include <algorithm>
+#include <atomic>
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <map>
 #include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <climits>
+#include <cmath>
+#include <csignal>
+#include <functional>
 #include <tree_sitter/api.h>
 #include <vector>
 #include <filesystem>
 #include <chrono>
 #include <iomanip>
+#include <mutex>
+#include <regex>
 #include <sstream>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
 #define InsertTraceToFunction 1
 
 #define WriteInsertTrace 1
@@ -50,11 +67,17 @@
                                                             log_file << NodeName << " has error--->\n" << NodeCode << std::endl; \
                                                             std::cout<<"\033[1;31m"<<NodeName<<" has error--->\033[0m\n"<<NodeCode<<std::endl; \
                                                             if (ts_node_child_count(node) > 0) { \
-                                                                traverse_and_print(ts_node_named_child(node, 0), source_code, insertions,log_file,ignore_function_list); \
+                                                                traverse_and_print(ts_node_named_child(node, 0), source_code, insertions,log_file,ignore_function_list,options,stats); \
                                                             } \
                                                             node = ts_node_next_named_sibling(node); \
                                                             continue;
 
+// 按规则跳过函数并计数，然后切换到下一个node
+#define NODE_SKIP_CONTINUE(RuleName) \
+                                                            stats.skipped[RuleName]++; \
+                                                            node = ts_node_next_named_sibling(node); \
+                                                            continue;
+
 // 输出绿色日志，并且切换到下一个node
 #define NODE_PRINT_CONTINUE(NodeName,NodeCode) \
                                                             log_file << NodeName << " has error--->\n" << NodeCode << std::endl; \
@@ -64,13 +87,494 @@
 
 extern "C" TSLanguage *tree_sitter_cpp();
 
+// 插入的Trace宏
+static const std::string trace_macro_name = "TRACE_CPUPROFILER_EVENT_SCOPE_WHEN_TRACING";
+
+// 插入的Trace宏后面可选的标记，去除Trace时不需要解析，直接按字节查找
+static const std::string trace_marker = "/*AT*/";
+
+// 迁移过的手写Trace/Stat后面的标记，宏名和插入的一样，去除Trace时跳过
+static const std::string migrated_marker = "/*ATM*/";
+
+// 按函数ID插入的Trace宏，函数名等信息在生成的注册表中
+static const std::string trace_id_macro_name = "AUTO_TRACE_SCOPE_ID";
+
+// 按函数ID插入，先检查运行时的函数开关位再记录Trace事件
+static const std::string trace_gated_macro_name = "AUTO_TRACE_SCOPE_GATED";
+
+// 按函数ID插入，只累计调用次数和耗时，不记录Trace事件
+static const std::string trace_counter_macro_name = "AUTO_TRACE_COUNTER_SCOPE";
+
+// 按函数ID插入，每个线程每N次调用才打开一次Trace
+static const std::string trace_sampled_macro_name = "AUTO_TRACE_SCOPE_SAMPLED";
+
+// 按函数ID插入到递归函数，每个线程只记录最外层的调用
+static const std::string trace_outermost_macro_name = "AUTO_TRACE_SCOPE_OUTERMOST";
+
+// 按函数名插入的开关宏，定义在生成的小头文件里，AUTO_TRACE_ENABLED=0时展开为空
+static const std::string trace_switch_macro_name = "AUTO_TRACE_SCOPE";
+
+// 工具会插入的所有Trace宏，用于判断重复插入和去除；宏规则里用到的其他宏只按trace_marker识别
+static const std::vector<std::string> auto_trace_macro_names = {trace_macro_name, trace_id_macro_name, trace_gated_macro_name, trace_counter_macro_name, trace_sampled_macro_name, trace_outermost_macro_name, trace_switch_macro_name};
+
+// 生成的头文件和源文件，放在源目录下
+static const std::string generated_header_name = "AutoTrace.gen.h";
+static const std::string generated_source_name = "AutoTrace.gen.cpp";
+// 开关宏的头文件，不依赖注册表
+static const std::string generated_switch_header_name = "AutoTraceSwitch.gen.h";
+
+// 函数ID注册表，记录在源目录下，每次运行保持ID不变
+static const std::string registry_file_name = "AutoTrace.registry";
+
+// 注册表中的一个函数
+struct FunctionRegistryEntry {
+    uint32_t id = 0;
+    std::string name;
+    std::string file;
+    uint32_t line = 0;
+};
+
+// 函数ID注册表，ID从0开始连续分配，按 文件|函数名 查找，已分配的ID不会改变
+struct FunctionRegistry {
+    std::vector<FunctionRegistryEntry> entries;
+    std::unordered_map<std::string, uint32_t> ids;
+
+    uint32_t get_or_add(const std::string& name, const std::string& file, uint32_t line) {
+        std::string key = file + "|" + name;
+        auto it = ids.find(key);
+        if (it != ids.end()) {
+            entries[it->second].line = line;
+            return it->second;
+        }
+        uint32_t id = static_cast<uint32_t>(entries.size());
+        entries.push_back({id, name, file, line});
+        ids[key] = id;
+        return id;
+    }
+};
+
+// 本文件内的调用关系，函数都用名字的最后一段表示，只记录本文件内定义的函数
+struct CallGraph {
+    // 被调用函数 -> 调用它的函数
+    std::unordered_map<std::string, std::unordered_set<std::string>> callers;
+    // 被调用函数 -> 每个调用点的循环嵌套层数，0表示不在循环里
+    std::unordered_map<std::string, std::vector<uint32_t>> call_loop_depths;
+    // 在循环里被调用的函数
+    std::unordered_set<std::string> loop_callees;
+    // 只有一个调用者并且调用者会插入Trace的函数，调用者的Trace已经包含了它的耗时
+    std::unordered_set<std::string> single_caller_callees;
+    // 能确定递归的函数 -> 递归的调用链，例如 A -> B -> A
+    // 只算直接调用自己的函数和同一个类(或都是自由函数)里的相互递归
+    std::unordered_map<std::string, std::string> recursive_functions;
+
+    // 估算不插入这个函数时，调用者每执行一次少产生的Trace事件数量
+    double estimate_events(const std::string& short_name, double loop_trip) const {
+        double events = 0.0;
+        auto depths_it = call_loop_depths.find(short_name);
+        if (depths_it != call_loop_depths.end()) {
+            for (uint32_t depth : depths_it->second) {
+                events += std::pow(loop_trip, depth);
+            }
+        }
+        return events;
+    }
+};
+
+// 宏规则: 按路径/类/函数名选择插入的宏，按顺序第一条匹配的生效
+struct MacroRule {
+    // 预先编译好的匹配: 相对路径、类名、函数名(最后一段)，规则里写的是*和?通配符
+    std::regex path_pattern;
+    std::regex class_pattern;
+    std::regex function_pattern;
+    // 宏模板，例如 TRACE_CPUPROFILER_EVENT_SCOPE_ON_CHANNEL({Name}, SlateChannel)，为空表示不插入
+    std::string macro_template;
+    // 规则原文，用于日志
+    std::string text;
+};
+
+// 插入选项
+struct TraceOptions {
+    // 在插入的Trace宏后面加上trace_marker
+    bool insert_marker = false;
+    // 迁移已有的Trace/Stat，函数体里有会被迁移的计时宏时不再插入
+    bool migrate = false;
+
+    // 静态开销过滤: 跳过太简单的函数，减少几乎没有耗时的Trace事件
+    // 函数体内语句数量少于这个值的函数不插入，0表示不限制
+    uint32_t min_statements = 0;
+    // 函数体字节数少于这个值的函数不插入，0表示不限制
+    uint32_t min_body_bytes = 0;
+    // 函数体内没有循环也没有函数调用的不插入
+    bool require_loop_or_call = false;
+    // 函数体只有一条return语句的不插入
+    bool skip_pure_return = false;
+
+    // 插入到函数开头的提前返回检查(if return/continue、check/ensure)之后
+    bool insert_after_guards = false;
+    // Trace和第一条语句放在同一行，不增加行，行号不变
+    bool same_line = false;
+
+    // 按函数属性和宏跳过的规则，可以用--skip/--no-skip单独开关
+    //   forceinline         FORCEINLINE/FORCEINLINE_DEBUGGABLE，插入后会破坏内联
+    //   inline              inline函数
+    //   consteval           consteval函数，不能插入
+    //   nodiscard-accessor  UE_NODISCARD/[[nodiscard]]并且只有一条return的访问函数
+    //   anon-loop-callee    匿名命名空间中在本文件循环里被调用的函数
+    //   noexcept            noexcept/noexcept(true)函数，noexcept(false)不跳过
+    //   forcenoinline       FORCENOINLINE函数(默认关闭)
+    //   loop-callee         本文件循环里调用的本文件函数(默认关闭)
+    //   single-caller       本文件内只有一个会插入Trace的调用者的函数(默认关闭)
+    //   recursive           直接递归或者本文件内相互递归的函数(默认关闭)
+    std::unordered_set<std::string> attribute_rules = {"forceinline", "inline", "noexcept", "consteval", "nodiscard-accessor", "anon-loop-callee"};
+    // 当前文件的调用关系
+    const CallGraph* call_graph = nullptr;
+    // 估算节省的Trace事件时假设每个循环执行的次数
+    double loop_trip = 10.0;
+
+    // 按函数名插入时使用的宏
+    std::string name_macro_name = trace_macro_name;
+
+    // 预处理: 已知定义的宏和值、已知没有定义的宏，其他的宏当作未知，条件未知的分支都处理
+    std::unordered_map<std::string, std::string> defines;
+    std::unordered_set<std::string> undefs;
+    // 当前文件中按defines/undefs判断不会编译的字节范围[start, end)，为空指针表示不判断
+    const std::vector<std::pair<uint32_t, uint32_t>>* inactive_ranges = nullptr;
+
+    // 函数ID注册表，为空指针表示都插入函数名
+    FunctionRegistry* registry = nullptr;
+    // 所有Trace都按函数ID插入，否则只有需要ID的函数(采样等)按ID插入，其他函数仍然插入函数名
+    bool id_all = false;
+    // 按函数ID插入时使用的宏
+    std::string id_macro_name = trace_id_macro_name;
+    // 当前文件相对于源目录的路径
+    std::string relative_path;
+    // 递归函数插入只记录最外层调用的Trace
+    bool outermost_recursive = false;
+    // 宏规则，为空指针表示都插入默认的宏
+    const std::vector<MacroRule>* macro_rules = nullptr;
+    // 宏规则中用到的宏名，函数开头已经有这些宏时不再插入
+    std::vector<std::string> rule_macro_names;
+    // 当前文件中按1/N采样插入的函数和N，为空指针表示不采样
+    const std::unordered_map<std::string, uint32_t>* sample_functions = nullptr;
+    // 当前文件中需要给循环体插入Trace的函数和最小循环字节数(0表示用loop_min_bytes)
+    const std::unordered_map<std::string, uint32_t>* loop_functions = nullptr;
+    // 循环语句字节数少于这个值的不插入
+    uint32_t loop_min_bytes = 256;
+    // 协程不在函数开头插入，只给不包含挂起点的代码块插入Trace
+    bool coroutine_segments = false;
+    // 作为参数传给这些函数(名字的最后一段)的lambda插入Trace，为空表示不处理lambda
+    std::unordered_set<std::string> lambda_calls;
+
+    // 全局预算: 最多插入多少个函数，0表示不限制
+    size_t budget_count = 0;
+    // 全局预算: 最多插入候选函数的百分之多少，0表示不限制
+    double budget_percent = 0.0;
+    // 收集候选函数，不插入
+    bool collect_candidates = false;
+    // 当前文件中被预算选中的函数(函数名@行号)，为空指针表示不按预算选择
+    const std::unordered_set<std::string>* budget_selection = nullptr;
+};
+
+// 函数的静态权重，用于在预算内选择最有价值的函数
+struct FunctionWeight {
+    // 函数体内的语法节点数量
+    uint32_t ast_nodes = 0;
+    // 最大循环嵌套层数
+    uint32_t loop_depth = 0;
+    // 函数调用数量
+    uint32_t calls = 0;
+    // 是否直接递归
+    bool recursive = false;
+    double score = 0.0;
+
+    // 函数越大、调用越多、循环越深越值得插入
+    void finish() {
+        score = ast_nodes + 8.0 * calls + 50.0 * loop_depth * loop_depth + (recursive ? 100.0 : 0.0);
+    }
+};
+
+// 候选函数
+struct TraceCandidate {
+    std::string file;
+    std::string function_name;
+    uint32_t line = 0;
+    FunctionWeight weight;
+};
+
+// 获取名字的最后一段，例如 SWidget::Paint -> Paint，Child->Paint -> Paint
+std::string get_short_name(const std::string& name) {
+    size_t separator = name.find_last_of(":.>");
+    return name.substr(separator == std::string::npos ? 0 : separator + 1);
+}
+
+// 获取call_expression调用的函数名的最后一段，模板参数会被去掉
+std::string get_callee_short_name(TSNode call_node, const std::string& source_code) {
+    TSNode callee_node = ts_node_child_by_field_name(call_node, "function", strlen("function"));
+    if (ts_node_is_null(callee_node)) {
+        return "";
+    }
+    std::string callee = source_code.substr(ts_node_start_byte(callee_node), ts_node_end_byte(callee_node) - ts_node_start_byte(callee_node));
+    size_t template_start = callee.find('<');
+    if (template_start != std::string::npos) {
+        callee.resize(template_start);
+    }
+    return get_short_name(callee);
+}
+
+// 去掉名字中的模板参数，例如 TArray<int>::Num -> TArray::Num
+std::string strip_template_arguments(const std::string& name) {
+    std::string result;
+    int depth = 0;
+    for (char c : name) {
+        if (c == '<') {
+            depth++;
+        } else if (c == '>' && depth > 0) {
+            depth--;
+        } else if (depth == 0) {
+            result += c;
+        }
+    }
+    return result;
+}
+
+/**
+ * \brief 函数所在的类和命名空间: 函数名的限定部分和外层的类、命名空间定义
+ * 例如 namespace UI { void SWidget::Paint() } -> SWidget、UI
+ */
+std::unordered_set<std::string> get_enclosing_scopes(TSNode function_node, const std::string& function_name, const std::string& source_code) {
+    std::unordered_set<std::string> scopes;
+    std::string qualified_name = strip_template_arguments(function_name);
+    for (size_t separator = qualified_name.rfind("::"); separator != std::string::npos && separator > 0; separator = qualified_name.rfind("::", separator - 1)) {
+        std::string qualifier = qualified_name.substr(0, separator);
+        scopes.insert(qualifier);
+        size_t last_separator = qualifier.rfind("::");
+        scopes.insert(last_separator == std::string::npos ? qualifier : qualifier.substr(last_separator + 2));
+    }
+    for (TSNode parent = ts_node_parent(function_node); ts_node_is_null(parent) == false; parent = ts_node_parent(parent)) {
+        const char* type = ts_node_type(parent);
+        if (strcmp(type, "class_specifier") == 0 || strcmp(type, "struct_specifier") == 0 || strcmp(type, "namespace_definition") == 0) {
+            TSNode name_node = ts_node_child_by_field_name(parent, "name", strlen("name"));
+            if (ts_node_is_null(name_node) == false) {
+                scopes.insert(strip_template_arguments(source_code.substr(ts_node_start_byte(name_node), ts_node_end_byte(name_node) - ts_node_start_byte(name_node))));
+            }
+        }
+    }
+    return scopes;
+}
+
+/**
+ * \brief 获取能确定是调用本类或本命名空间函数的call_expression的函数名最后一段
+ * 只认不带限定的调用、this->调用和限定名是所在类或命名空间(scopes)的调用
+ * obj.f()、ptr->f()、Super::f()调用的不一定是本文件里的同名函数，返回空
+ */
+std::string get_resolvable_callee_short_name(TSNode call_node, const std::string& source_code, const std::unordered_set<std::string>& scopes) {
+    TSNode callee_node = ts_node_child_by_field_name(call_node, "function", strlen("function"));
+    if (ts_node_is_null(callee_node)) {
+        return "";
+    }
+    const char* type = ts_node_type(callee_node);
+    if (strcmp(type, "field_expression") == 0) {
+        TSNode argument_node = ts_node_child_by_field_name(callee_node, "argument", strlen("argument"));
+        TSNode field_node = ts_node_child_by_field_name(callee_node, "field", strlen("field"));
+        if (ts_node_is_null(argument_node) || ts_node_is_null(field_node)
+            || source_code.compare(ts_node_start_byte(argument_node), ts_node_end_byte(argument_node) - ts_node_start_byte(argument_node), "this") != 0) {
+            return "";
+        }
+        return strip_template_arguments(source_code.substr(ts_node_start_byte(field_node), ts_node_end_byte(field_node) - ts_node_start_byte(field_node)));
+    }
+    if (strcmp(type, "identifier") != 0 && strcmp(type, "template_function") != 0 && strcmp(type, "qualified_identifier") != 0) {
+        return "";
+    }
+    std::string callee = strip_template_arguments(source_code.substr(ts_node_start_byte(callee_node), ts_node_end_byte(callee_node) - ts_node_start_byte(callee_node)));
+    size_t separator = callee.rfind("::");
+    if (separator == std::string::npos) {
+        return callee;
+    }
+    std::string qualifier = callee.substr(0, separator);
+    if (qualifier.compare(0, 2, "::") == 0) {
+        qualifier = qualifier.substr(2);
+    }
+    return scopes.count(qualifier) > 0 ? callee.substr(separator + 2) : "";
+}
+
+// 是否是循环语句
+bool ts_is_loop_node(TSNode node) {
+    const char* type = ts_node_type(node);
+    return strcmp(type, "for_statement") == 0 || strcmp(type, "for_range_loop") == 0 || strcmp(type, "while_statement") == 0 || strcmp(type, "do_statement") == 0;
+}
+
+// 节点是否在匿名命名空间里
+bool ts_is_in_anonymous_namespace(TSNode node) {
+    for (TSNode parent = ts_node_parent(node); ts_node_is_null(parent) == false; parent = ts_node_parent(parent)) {
+        if (strcmp(ts_node_type(parent), "namespace_definition") == 0 && ts_node_is_null(ts_node_child_by_field_name(parent, "name", strlen("name")))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 拆分出文本中所有的标识符
+std::unordered_set<std::string> get_identifier_tokens(const std::string& text) {
+    std::unordered_set<std::string> tokens;
+    std::string token;
+    for (char c : text) {
+        if (isalnum(static_cast<unsigned char>(c)) || c == '_') {
+            token += c;
+        } else if (!token.empty()) {
+            tokens.insert(token);
+            token.clear();
+        }
+    }
+    if (!token.empty()) {
+        tokens.insert(token);
+    }
+    return tokens;
+}
+
+// 统计函数体的语法节点数量、循环嵌套、函数调用和递归
+void measure_function_weight(TSNode node, const std::string& source_code, const std::string& short_name, const std::unordered_set<std::string>& scopes, uint32_t loop_depth, FunctionWeight& weight) {
+    uint32_t child_count = ts_node_named_child_count(node);
+    for (uint32_t i = 0; i < child_count; i++) {
+        TSNode child_node = ts_node_named_child(node, i);
+        const char* type = ts_node_type(child_node);
+        weight.ast_nodes++;
+
+        uint32_t child_loop_depth = loop_depth;
+        if (ts_is_loop_node(child_node)) {
+            child_loop_depth++;
+            weight.loop_depth = std::max(weight.loop_depth, child_loop_depth);
+        } else if (strcmp(type, "call_expression") == 0) {
+            weight.calls++;
+            if (get_resolvable_callee_short_name(child_node, source_code, scopes) == short_name) {
+                weight.recursive = true;
+            }
+        }
+        measure_function_weight(child_node, source_code, short_name, scopes, child_loop_depth, weight);
+    }
+}
+
+// 插入统计
+struct TraceStats {
+    size_t instrumented = 0;
+    // 在忽略列表中并且去掉了之前插入的Trace的函数数量
+    size_t stripped = 0;
+    // 插入的循环Trace数量
+    size_t loop_scopes = 0;
+    // 插入的lambda Trace数量
+    size_t lambda_scopes = 0;
+    // 跳过的协程(文件:行号 函数名)
+    std::vector<std::string> coroutines;
+    // 协程里插入的不包含挂起点的代码块Trace数量
+    size_t coroutine_segment_scopes = 0;
+    // 按调用关系跳过后，估算调用者每执行一次少产生的Trace事件数量之和
+    double estimated_events_saved = 0.0;
+    // 迁移成_WHEN_TRACING的已有Trace/Stat数量
+    size_t migrated = 0;
+    // 迁移时发现冲突、没有修改的数量
+    size_t migrate_conflicts = 0;
+    // 按函数ID插入的Trace数量，插入过的文件需要包含生成的头文件
+    size_t id_scopes = 0;
+    // 之前插入的按名字的Trace改成现在的名字宏(例如开关宏)的数量
+    size_t renamed = 0;
+    // 开头已经有之前插入的Trace的函数数量，按预算选择时计入预算
+    size_t existing_scopes = 0;
+    // 每条规则跳过的函数数量
+    std::map<std::string, size_t> skipped;
+    // 按预算选择时收集的候选函数
+    std::vector<TraceCandidate> candidates;
+};
+
+// 按权重排序候选函数，在预算内选择权重最高的函数，并导出排名
+// 之前运行已经插入的existing_scopes个函数占用预算，重复运行不会超过预算
+// 返回 相对路径 -> 选中的函数(函数名@行号)
+std::unordered_map<std::string, std::unordered_set<std::string>> select_by_budget(std::vector<TraceCandidate>& candidates, size_t existing_scopes, const TraceOptions& options, const std::string& ranking_filename) {
+    std::stable_sort(candidates.begin(), candidates.end(), [](const TraceCandidate& a, const TraceCandidate& b) {
+        return a.weight.score > b.weight.score;
+    });
+
+    size_t total = candidates.size() + existing_scopes;
+    size_t budget = total;
+    if (options.budget_count > 0) {
+        budget = std::min(budget, options.budget_count);
+    }
+    if (options.budget_percent > 0.0) {
+        budget = std::min(budget, static_cast<size_t>(total * options.budget_percent / 100.0));
+    }
+    size_t limit = budget > existing_scopes ? budget - existing_scopes : 0;
+
+    std::unordered_map<std::string, std::unordered_set<std::string>> selection;
+    std::ofstream ranking(ranking_filename, std::ios::binary | std::ios::trunc);
+    ranking << "rank,score,ast_nodes,loop_depth,calls,recursive,selected,file,line,function\n";
+    for (size_t i = 0; i < candidates.size(); i++) {
+        const TraceCandidate& candidate = candidates[i];
+        bool selected = i < limit;
+        if (selected) {
+            selection[candidate.file].insert(candidate.function_name + "@" + std::to_string(candidate.line));
+        }
+        ranking << i + 1 << ',' << candidate.weight.score << ',' << candidate.weight.ast_nodes << ',' << candidate.weight.loop_depth << ','
+                << candidate.weight.calls << ',' << (candidate.weight.recursive ? 1 : 0) << ',' << (selected ? 1 : 0) << ','
+                << candidate.file << ',' << candidate.line << ",\"" << candidate.function_name << "\"\n";
+    }
+    return selection;
+}
+
+void print_trace_stats(const TraceStats& stats, std::ofstream& log_file) {
+    PRINT_MSG_GREEN("instrumented functions: " << stats.instrumented)
+    if (stats.stripped > 0) {
+        PRINT_MSG_GREEN("stripped ignored functions: " << stats.stripped)
+    }
+    if (stats.loop_scopes > 0) {
+        PRINT_MSG_GREEN("instrumented loops: " << stats.loop_scopes)
+    }
+    if (stats.lambda_scopes > 0) {
+        PRINT_MSG_GREEN("instrumented lambdas: " << stats.lambda_scopes)
+    }
+    if (!stats.coroutines.empty()) {
+        PRINT_MSG("coroutines, not scoped across suspension points: " << stats.coroutines.size() << ", synchronous segments instrumented: " << stats.coroutine_segment_scopes)
+        for (const auto& coroutine : stats.coroutines) {
+            PRINT_MSG("  " << coroutine)
+        }
+    }
+    if (stats.estimated_events_saved > 0.0) {
+        PRINT_MSG_GREEN("estimated trace events saved per call of their callers: " << stats.estimated_events_saved)
+    }
+    if (stats.renamed > 0) {
+        PRINT_MSG_GREEN("renamed existing scopes: " << stats.renamed)
+    }
+    if (stats.migrated > 0 || stats.migrate_conflicts > 0) {
+        PRINT_MSG_GREEN("migrated scopes: " << stats.migrated << ", conflicts: " << stats.migrate_conflicts)
+    }
+    for (const auto& rule : stats.skipped) {
+        PRINT_MSG("skipped by " << rule.first << ": " << rule.second)
+    }
+}
+
+// 文本修改: 删除从start开始的length个字节，然后插入text
+struct TextEdit {
+    size_t start;
+    size_t length;
+    std::string text;
+};
+
+// 按照位置从大到小的顺序修改，这样不会影响到其他修改位置的正确性
+void apply_text_edits(std::string& source_code, std::vector<TextEdit>& edits) {
+    std::stable_sort(edits.begin(), edits.end(), [](const TextEdit& a, const TextEdit& b) {
+        return a.start > b.start;
+    });
+
+    for (const auto& edit : edits) {
+        source_code.replace(edit.start, edit.length, edit.text);
+    }
+}
+
 // 遍历目录并找到所有的 .cpp 文件
 std::vector<std::string> find_cpp_files(const std::string& path) {
     std::vector<std::string> cpp_files;
     std::filesystem::path fs_path(path);
     if (std::filesystem::is_directory(fs_path)) {
         for (const auto& entry : std::filesystem::recursive_directory_iterator(fs_path)) {
-            if (entry.path().extension() == ".cpp") {
+            // 跳过工具自己生成的源文件
+            if (entry.path().extension() == ".cpp" && entry.path().filename() != generated_source_name) {
                 cpp_files.push_back(entry.path().string());
             }
         }
@@ -80,140 +584,2491 @@ std::vector<std::string> find_cpp_files(const std::string& path) {
     return cpp_files;
 }
 
-// 备份文件
-void backup_files(const std::vector<std::string>& files, const std::string& source_directory, const std::string& backup_directory) {
-    std::filesystem::create_directories(backup_directory);
-    for (const auto& file : files) {
-        // 获取文件相对于源目录的路径
-        std::filesystem::path relative_path = std::filesystem::relative(file, source_directory);
+// 计算内容的哈希(FNV-1a 64位)
+uint64_t hash_bytes(const std::string& data) {
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : data) {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// 哈希转为16位十六进制字符串
+std::string hash_to_hex(uint64_t hash) {
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(hash));
+    return buf;
+}
+
+// 以二进制方式读取整个文件，读取失败返回false
+bool read_file_bytes(const std::filesystem::path& path, std::string& data) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    data.assign((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    return true;
+}
+
+// 以二进制方式写入整个文件，先写临时文件再改名，中途退出不会留下写了一半的文件
+bool write_file_bytes(const std::filesystem::path& path, const std::string& data) {
+    std::filesystem::path temp_path = path;
+    temp_path += ".tmp";
+    {
+        std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+        if (!file) {
+            return false;
+        }
+        file.write(data.data(), data.size());
+        if (!file) {
+            return false;
+        }
+    }
+    std::error_code ec;
+    std::filesystem::rename(temp_path, path, ec);
+    return !ec;
+}
+
+// 获取源目录，传入单个文件时使用它所在的目录
+std::string get_source_root(const std::string& path) {
+    std::filesystem::path fs_path(path);
+    if (std::filesystem::is_directory(fs_path)) {
+        return fs_path.string();
+    }
+    return fs_path.parent_path().string();
+}
+
+// 备份仓库目录结构:
+//   objects/<key前两位>/<key>   按内容寻址的文件内容，相同内容只保存一份
+//   runs/<run>.manifest         每次运行的清单，每行: key\t相对路径[\t插入后的key]
+// key = 内容哈希_文件大小，只有被本次运行修改过的文件才有插入后的key
+std::filesystem::path store_object_path(const std::string& store_directory, const std::string& key) {
+    return std::filesystem::path(store_directory) / "objects" / key.substr(0, 2) / key;
+}
 
-        // 在备份目录中创建相同的路径
-        std::filesystem::path backup_path = backup_directory / relative_path;
+std::filesystem::path store_manifest_path(const std::string& store_directory, const std::string& run_name) {
+    return std::filesystem::path(store_directory) / "runs" / (run_name + ".manifest");
+}
 
-        // 创建备份文件的目录
-        std::filesystem::create_directories(backup_path.parent_path());
+// 运行清单中的一个文件
+struct BackupEntry {
+    std::string key;
+    std::string relative_path;
+    std::string written_key;
+};
 
-        // 复制文件
-        std::filesystem::copy(file, backup_path, std::filesystem::copy_options::overwrite_existing);
+// 计算内容的key
+std::string store_object_key(const std::string& data) {
+    return hash_to_hex(hash_bytes(data)) + "_" + std::to_string(data.size());
+}
 
-        // 设置备份文件的最后修改时间为当前时间
-        std::filesystem::last_write_time(backup_path, std::filesystem::file_time_type::clock::now());
+// 保存内容到备份仓库，已存在相同内容时直接复用，返回key
+std::string store_put_object(const std::string& store_directory, const std::string& data) {
+    std::string key = store_object_key(data);
+    std::filesystem::path object_path = store_object_path(store_directory, key);
+    if (!std::filesystem::exists(object_path)) {
+        std::error_code ec;
+        std::filesystem::create_directories(object_path.parent_path(), ec);
+        if (!write_file_bytes(object_path, data)) {
+            return "";
+        }
     }
+    return key;
 }
 
-// 读取忽略列表
-std::unordered_map<std::string, std::unordered_set<std::string>> read_ignore_list(const std::string& filename) {
-    std::unordered_map<std::string, std::unordered_set<std::string>> ignore_list;
-    std::ifstream file(filename);
+// 按名字顺序(也就是时间顺序)列出备份仓库里的所有运行记录
+std::vector<std::string> store_list_runs(const std::string& store_directory) {
+    std::vector<std::string> runs;
+    std::filesystem::path runs_directory = std::filesystem::path(store_directory) / "runs";
+    if (!std::filesystem::is_directory(runs_directory)) {
+        return runs;
+    }
+    for (const auto& entry : std::filesystem::directory_iterator(runs_directory)) {
+        if (entry.path().extension() == ".manifest") {
+            runs.push_back(entry.path().stem().string());
+        }
+    }
+    std::sort(runs.begin(), runs.end());
+    return runs;
+}
+
+// 读取运行清单
+std::vector<BackupEntry> store_read_manifest(const std::string& store_directory, const std::string& run_name) {
+    std::vector<BackupEntry> entries;
+    std::ifstream file(store_manifest_path(store_directory, run_name), std::ios::binary);
     std::string line;
     while (std::getline(file, line)) {
-        std::istringstream iss(line);
-        std::string file_name, function_name;
-        if (!(iss >> file_name >> function_name)) { break; } // error
-        ignore_list[file_name].insert(function_name);
+        size_t tab = line.find('\t');
+        if (tab == std::string::npos) {
+            continue;
+        }
+        BackupEntry entry;
+        entry.key = line.substr(0, tab);
+        entry.relative_path = line.substr(tab + 1);
+        size_t written_tab = entry.relative_path.find('\t');
+        if (written_tab != std::string::npos) {
+            entry.written_key = entry.relative_path.substr(written_tab + 1);
+            entry.relative_path.resize(written_tab);
+        }
+        entries.push_back(entry);
     }
-    return ignore_list;
+    return entries;
 }
 
-TSNode ts_node_child_by_node_type(TSNode node,const char* in_node_type)
-{
-	for(int i=0;i<ts_node_child_count(node);i++)
-    {
-        TSNode child_node = ts_node_child(node, i);
-        const char* node_type = ts_node_type(child_node);
-        if (strcmp(node_type, in_node_type) == 0)
+// 写入运行清单
+bool store_write_manifest(const std::string& store_directory, const std::string& run_name, const std::vector<BackupEntry>& entries) {
+    std::string data;
+    for (const auto& entry : entries) {
+        data += entry.key + '\t' + entry.relative_path;
+        if (!entry.written_key.empty()) {
+            data += '\t' + entry.written_key;
+        }
+        data += '\n';
+    }
+    std::filesystem::create_directories(store_manifest_path(store_directory, run_name).parent_path());
+    return write_file_bytes(store_manifest_path(store_directory, run_name), data);
+}
+
+// 运行日志(预写日志)，只追加，记录每个文件的处理状态，运行被中断后下次从中断的地方继续
+// 第一行: run\t运行名\t模式，之后每行: 状态\t相对路径\t值
+//   backup   已备份，值为原始内容的key
+//   parsed   已解析，值为修改的数量
+//   begin    准备覆盖文件，值为修改后内容的key
+//   written  已覆盖文件，值为修改后内容的key
+// 每条记录都会flush，进程被杀掉不会丢记录；每隔一段时间fsync一次，防止断电丢失
+struct RunJournal {
+    FILE* file = nullptr;
+    size_t unsynced_records = 0;
+    std::chrono::steady_clock::time_point last_sync_time;
+
+    bool open(const std::filesystem::path& path) {
+        // 中断时最后一行可能只写了一半，换行后再追加
+        bool needs_newline = false;
         {
-	        return child_node;
+            std::ifstream existing(path, std::ios::binary | std::ios::ate);
+            if (existing && existing.tellg() > 0) {
+                existing.seekg(-1, std::ios::end);
+                needs_newline = existing.get() != '\n';
+            }
         }
+        file = fopen(path.string().c_str(), "ab");
+        if (file != nullptr && needs_newline) {
+            fputc('\n', file);
+        }
+        last_sync_time = std::chrono::steady_clock::now();
+        return file != nullptr;
     }
-    return TSNode();
+
+    void record(const std::string& state, const std::string& relative_path, const std::string& value) {
+        if (file == nullptr) {
+            return;
+        }
+        fprintf(file, "%s\t%s\t%s\n", state.c_str(), relative_path.c_str(), value.c_str());
+        fflush(file);
+        if (++unsynced_records >= 256 || std::chrono::steady_clock::now() - last_sync_time > std::chrono::seconds(1)) {
+            sync();
+        }
+    }
+
+    void sync() {
+        if (file == nullptr) {
+            return;
+        }
+        fflush(file);
+#ifdef _WIN32
+        _commit(_fileno(file));
+#else
+        fsync(fileno(file));
+#endif
+        unsynced_records = 0;
+        last_sync_time = std::chrono::steady_clock::now();
+    }
+
+    void close() {
+        if (file != nullptr) {
+            sync();
+            fclose(file);
+            file = nullptr;
+        }
+    }
+};
+
+// 运行日志中单个文件的状态
+struct JournalFileState {
+    std::string backup_key;
+    std::string begin_key;
+    std::string written_key;
+    bool parsed_without_edits = false;
+};
+
+std::filesystem::path store_journal_path(const std::string& store_directory) {
+    return std::filesystem::path(store_directory) / "current.journal";
 }
 
-TSNode ts_find_node_by_type(TSNode node, const char* node_type) {
-    // 获取当前节点的类型
-    const char* type = ts_node_type(node);
+// 读取上次被中断的运行日志，返回false表示没有需要继续的运行
+bool load_journal(const std::string& store_directory, std::string& run_name, std::string& mode, std::unordered_map<std::string, JournalFileState>& states) {
+    std::ifstream file(store_journal_path(store_directory), std::ios::binary);
+    std::string line;
+    while (std::getline(file, line)) {
+        std::vector<std::string> fields;
+        std::istringstream iss(line);
+        std::string field;
+        while (std::getline(iss, field, '\t')) {
+            fields.push_back(field);
+        }
+        if (fields.size() < 3) {
+            // 最后一行可能只写了一半
+            continue;
+        }
+        if (fields[0] == "run") {
+            run_name = fields[1];
+            mode = fields[2];
+        } else if (fields[0] == "backup") {
+            states[fields[1]].backup_key = fields[2];
+        } else if (fields[0] == "parsed") {
+            states[fields[1]].parsed_without_edits = fields[2] == "0";
+        } else if (fields[0] == "begin") {
+            states[fields[1]].begin_key = fields[2];
+        } else if (fields[0] == "written") {
+            states[fields[1]].written_key = fields[2];
+        }
+    }
+    return !run_name.empty();
+}
 
-    // 检查当前节点的类型是否是指定的类型
-    if (strcmp(type, node_type) == 0) {
-        return node;
+// 备份文件到备份仓库，并写入本次运行的清单
+// 继续上次被中断的运行时，已经备份过的文件不再备份
+// 有文件备份失败时返回false，不能继续修改文件
+bool backup_files(const std::vector<std::string>& files, const std::string& source_directory, const std::string& store_directory, const std::string& run_name, RunJournal& journal, const std::unordered_map<std::string, JournalFileState>& states, std::vector<BackupEntry>& entries) {
+    for (const auto& file : files) {
+        // 获取文件相对于源目录的路径
+        std::string relative_path = std::filesystem::relative(file, source_directory).generic_string();
+
+        auto state_it = states.find(relative_path);
+        if (state_it != states.end() && !state_it->second.backup_key.empty()) {
+            const JournalFileState& state = state_it->second;
+            // 日志里的备份对象可能已经被删除(例如被--gc)，还没有开始覆盖的文件仍是原始内容，重新备份
+            bool object_exists = std::filesystem::exists(store_object_path(store_directory, state.backup_key));
+            if (object_exists || !state.begin_key.empty()) {
+                if (!object_exists) {
+                    std::cout << "\033[1;31m" << "missing backup object " << state.backup_key << " for " << relative_path << ", file already rewritten, cannot back up again" << "\033[0m\n";
+                }
+                entries.push_back({state.backup_key, relative_path, state.written_key});
+                continue;
+            }
+        }
+
+        std::string data;
+        if (!read_file_bytes(file, data)) {
+            continue;
+        }
+
+        std::string key = store_put_object(store_directory, data);
+        if (key.empty()) {
+            std::cout << "\033[1;31m" << "backup failed: " << relative_path << "\033[0m\n";
+            journal.sync();
+            return false;
+        }
+        entries.push_back({key, relative_path, ""});
+        journal.record("backup", relative_path, key);
+    }
+    journal.sync();
+    store_write_manifest(store_directory, run_name, entries);
+    return true;
+}
+
+// 把某次运行修改过的文件恢复到源目录
+// 只恢复当前内容仍然等于插入后内容的文件，用户之后改过的文件拒绝覆盖(除非force)
+int restore_run(const std::string& store_directory, const std::string& run_name, const std::string& source_directory, bool force) {
+    std::vector<BackupEntry> entries = store_read_manifest(store_directory, run_name);
+    if (entries.empty()) {
+        std::cout << "run not found: " << run_name << "\n";
+        for (const auto& run : store_list_runs(store_directory)) {
+            std::cout << "  " << run << "\n";
+        }
+        return 1;
+    }
+
+    std::atomic<size_t> restored{0};
+    std::atomic<size_t> unchanged{0};
+    std::atomic<size_t> refused{0};
+    std::atomic<size_t> failed{0};
+    std::mutex print_mutex;
+    std::atomic<size_t> next_index{0};
+    auto worker = [&]() {
+        for (size_t index = next_index++; index < entries.size(); index = next_index++) {
+            const BackupEntry& entry = entries[index];
+            if (entry.written_key.empty()) {
+                continue;
+            }
+            std::filesystem::path target_path = std::filesystem::path(source_directory) / entry.relative_path;
+
+            std::string current;
+            read_file_bytes(target_path, current);
+            std::string current_key = store_object_key(current);
+            if (current_key == entry.key) {
+                unchanged++;
+                continue;
+            }
+            if (current_key != entry.written_key && !force) {
+                refused++;
+                std::lock_guard<std::mutex> lock(print_mutex);
+                std::cout << "\033[1;31m" << "edited since instrumented, not restored: " << entry.relative_path << "\033[0m\n";
+                continue;
+            }
+
+            std::string data;
+            if (!read_file_bytes(store_object_path(store_directory, entry.key), data)) {
+                failed++;
+                std::lock_guard<std::mutex> lock(print_mutex);
+                std::cout << "\033[1;31m" << "missing object " << entry.key << " for " << entry.relative_path << "\033[0m\n";
+                continue;
+            }
+            std::filesystem::create_directories(target_path.parent_path());
+            if (write_file_bytes(target_path, data)) {
+                restored++;
+            } else {
+                failed++;
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    unsigned int jobs = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned int i = 0; i < jobs; i++) {
+        threads.emplace_back(worker);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    std::cout << "restored " << restored << ", already original " << unchanged << ", refused " << refused << ", failed " << failed << " (run " << run_name << ")\n";
+    return (refused > 0 || failed > 0) ? 1 : 0;
+}
+
+// 只保留最近keep次运行，删除不再被任何清单和运行日志引用的内容
+void gc_store(const std::string& store_directory, size_t keep) {
+    // 被中断的运行还要继续或者回滚，它的清单和日志里的对象都不能删除
+    std::string journal_run_name;
+    std::string journal_mode;
+    std::unordered_map<std::string, JournalFileState> journal_states;
+    load_journal(store_directory, journal_run_name, journal_mode, journal_states);
+
+    std::vector<std::string> runs = store_list_runs(store_directory);
+    runs.erase(std::remove(runs.begin(), runs.end(), journal_run_name), runs.end());
+    size_t removed_runs = 0;
+    while (runs.size() > keep) {
+        std::filesystem::remove(store_manifest_path(store_directory, runs.front()));
+        runs.erase(runs.begin());
+        removed_runs++;
+    }
+
+    std::unordered_set<std::string> referenced;
+    for (const auto& run : runs) {
+        for (const auto& entry : store_read_manifest(store_directory, run)) {
+            referenced.insert(entry.key);
+        }
+    }
+    if (!journal_run_name.empty()) {
+        for (const auto& entry : store_read_manifest(store_directory, journal_run_name)) {
+            referenced.insert(entry.key);
+        }
+        for (const auto& state : journal_states) {
+            referenced.insert(state.second.backup_key);
+            referenced.insert(state.second.begin_key);
+            referenced.insert(state.second.written_key);
+        }
+    }
+
+    size_t removed_objects = 0;
+    std::filesystem::path objects_directory = std::filesystem::path(store_directory) / "objects";
+    if (std::filesystem::is_directory(objects_directory)) {
+        std::vector<std::filesystem::path> unreferenced;
+        for (const auto& entry : std::filesystem::recursive_directory_iterator(objects_directory)) {
+            if (entry.is_regular_file() && referenced.count(entry.path().filename().string()) == 0) {
+                unreferenced.push_back(entry.path());
+            }
+        }
+        for (const auto& path : unreferenced) {
+            std::filesystem::remove(path);
+            removed_objects++;
+        }
+    }
+    std::cout << "gc: removed " << removed_runs << " runs, " << removed_objects << " objects, kept " << runs.size() << " runs\n";
+}
+
+// 读取函数ID注册表，每行: id\t文件\t行号\t函数名
+FunctionRegistry read_function_registry(const std::string& filename) {
+    FunctionRegistry registry;
+    std::ifstream file(filename, std::ios::binary);
+    std::string line;
+    std::vector<FunctionRegistryEntry> entries;
+    while (std::getline(file, line)) {
+        std::vector<std::string> fields;
+        std::istringstream iss(line);
+        std::string field;
+        while (std::getline(iss, field, '\t')) {
+            fields.push_back(field);
+        }
+        if (fields.size() < 4) {
+            continue;
+        }
+        FunctionRegistryEntry entry;
+        entry.id = std::strtoul(fields[0].c_str(), nullptr, 10);
+        entry.file = fields[1];
+        entry.line = std::strtoul(fields[2].c_str(), nullptr, 10);
+        entry.name = fields[3];
+        entries.push_back(entry);
+    }
+    std::sort(entries.begin(), entries.end(), [](const FunctionRegistryEntry& a, const FunctionRegistryEntry& b) {
+        return a.id < b.id;
+    });
+    for (const auto& entry : entries) {
+        // ID必须连续，损坏的注册表从断开的地方重新分配
+        if (entry.id != registry.entries.size()) {
+            break;
+        }
+        registry.ids[entry.file + "|" + entry.name] = entry.id;
+        registry.entries.push_back(entry);
+    }
+    return registry;
+}
+
+// 写入函数ID注册表
+bool write_function_registry(const std::string& filename, const FunctionRegistry& registry) {
+    std::string data;
+    for (const auto& entry : registry.entries) {
+        data += std::to_string(entry.id) + '\t' + entry.file + '\t' + std::to_string(entry.line) + '\t' + entry.name + '\n';
+    }
+    return write_file_bytes(filename, data);
+}
+
+// 转义为C++字符串字面量
+std::string escape_cpp_string(const std::string& text) {
+    std::string escaped = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+        }
+        escaped += c;
+    }
+    return escaped + "\"";
+}
+
+// 模块名转换为可以用在C++标识符中的名字
+std::string get_module_identifier(const std::string& module_name) {
+    std::string identifier;
+    for (char c : module_name) {
+        identifier += isalnum(static_cast<unsigned char>(c)) ? c : '_';
+    }
+    if (identifier.empty() || isdigit(static_cast<unsigned char>(identifier[0]))) {
+        identifier = "M" + identifier;
+    }
+    return identifier;
+}
+
+// 替换文本中所有的from
+void replace_all(std::string& text, const std::string& from, const std::string& to) {
+    for (size_t pos = text.find(from); pos != std::string::npos; pos = text.find(from, pos + to.size())) {
+        text.replace(pos, from.size(), to);
+    }
+}
+
+// 生成的头文件模板，{Namespace}替换为模块的命名空间
+static const char* generated_header_template = R"(// Generated by AutoInsertTrace, do not edit.
+#pragma once
+
+#include "CoreMinimal.h"
+#include "ProfilingDebugging/CpuProfilerTrace.h"
+
+// Master switch: define AUTO_TRACE_ENABLED=0 to compile out every auto-inserted trace scope.
+#ifndef AUTO_TRACE_ENABLED
+#define AUTO_TRACE_ENABLED CPUPROFILERTRACE_ENABLED
+#endif
+
+// Counter scopes do not emit trace events, so they have their own switch and also work in builds without tracing.
+#ifndef AUTO_TRACE_COUNTERS_ENABLED
+#define AUTO_TRACE_COUNTERS_ENABLED 1
+#endif
+
+#if AUTO_TRACE_ENABLED || AUTO_TRACE_COUNTERS_ENABLED
+#if PLATFORM_CPU_X86_FAMILY
+#if PLATFORM_WINDOWS
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#define AUTO_TRACE_READ_CYCLES() __rdtsc()
+#else
+#define AUTO_TRACE_READ_CYCLES() FPlatformTime::Cycles64()
+#endif
+#endif
+
+namespace {Namespace}
+{
+	struct FFunctionInfo
+	{
+		const ANSICHAR* Name;
+		const ANSICHAR* File;
+		uint32 Line;
+	};
+
+	extern const uint32 FunctionCount;
+	extern const FFunctionInfo Functions[];
+	extern uint64 EnableBits[];
+
+	FORCEINLINE bool IsEnabled(uint32 FunctionId)
+	{
+		return ((EnableBits[FunctionId >> 6] >> (FunctionId & 63)) & 1) != 0;
+	}
+
+#if AUTO_TRACE_ENABLED
+	extern uint32 SpecIds[];
+
+	uint32 RegisterSpecId(uint32 FunctionId);
+
+	FORCEINLINE uint32 GetSpecId(uint32 FunctionId)
+	{
+		const uint32 SpecId = SpecIds[FunctionId];
+		return SpecId != 0 ? SpecId : RegisterSpecId(FunctionId);
+	}
+
+	// Registers the event type only while the channel is on, so the spec is always sent before the first event that uses it.
+	struct FIdScope
+	{
+		FORCEINLINE explicit FIdScope(uint32 FunctionId)
+			: bActive(UE_TRACE_CHANNELEXPR_IS_ENABLED(CpuChannel))
+		{
+			if (bActive)
+			{
+				FCpuProfilerTrace::OutputBeginEvent(GetSpecId(FunctionId));
+			}
+		}
+
+		FORCEINLINE ~FIdScope()
+		{
+			if (bActive)
+			{
+				FCpuProfilerTrace::OutputEndEvent();
+			}
+		}
+
+		bool bActive;
+	};
+
+	// Checks the function's enable bit before touching the trace at all.
+	struct FGatedScope
+	{
+		FORCEINLINE explicit FGatedScope(uint32 FunctionId)
+			: bActive(IsEnabled(FunctionId) && UE_TRACE_CHANNELEXPR_IS_ENABLED(CpuChannel))
+		{
+			if (bActive)
+			{
+				FCpuProfilerTrace::OutputBeginEvent(GetSpecId(FunctionId));
+			}
+		}
+
+		FORCEINLINE ~FGatedScope()
+		{
+			if (bActive)
+			{
+				FCpuProfilerTrace::OutputEndEvent();
+			}
+		}
+
+		bool bActive;
+	};
+
+	// Opens a scope only on every SampleEvery-th call of the site on each thread.
+	struct FSampledScope
+	{
+		FORCEINLINE FSampledScope(uint32 FunctionId, uint32& Countdown, uint32 SampleEvery)
+			: bActive(false)
+		{
+			if (Countdown != 0)
+			{
+				--Countdown;
+				return;
+			}
+			Countdown = SampleEvery - 1;
+			bActive = IsEnabled(FunctionId) && UE_TRACE_CHANNELEXPR_IS_ENABLED(CpuChannel);
+			if (bActive)
+			{
+				FCpuProfilerTrace::OutputBeginEvent(GetSpecId(FunctionId));
+			}
+		}
+
+		FORCEINLINE ~FSampledScope()
+		{
+			if (bActive)
+			{
+				FCpuProfilerTrace::OutputEndEvent();
+			}
+		}
+
+		bool bActive;
+	};
+
+	// Only the outermost call of a recursive function on each thread opens a scope.
+	struct FOutermostScope
+	{
+		FORCEINLINE FOutermostScope(uint32 FunctionId, uint32& InDepth)
+			: Depth(InDepth)
+			, bActive(Depth++ == 0 && IsEnabled(FunctionId) && UE_TRACE_CHANNELEXPR_IS_ENABLED(CpuChannel))
+		{
+			if (bActive)
+			{
+				FCpuProfilerTrace::OutputBeginEvent(GetSpecId(FunctionId));
+			}
+		}
+
+		FORCEINLINE ~FOutermostScope()
+		{
+			--Depth;
+			if (bActive)
+			{
+				FCpuProfilerTrace::OutputEndEvent();
+			}
+		}
+
+		uint32& Depth;
+		bool bActive;
+	};
+#endif
+
+#if AUTO_TRACE_COUNTERS_ENABLED
+	// One slot per function in each thread's array, aligned and padded to whole cache lines, so the hot path never shares a cache line with another thread.
+	struct FCounterSlot
+	{
+		uint64 Calls;
+		uint64 Cycles;
+	};
+
+	extern thread_local FCounterSlot* ThreadCounterSlots;
+
+	FCounterSlot* RegisterCounterThread();
+
+	// Accumulates call count and cycles instead of emitting a trace event per call.
+	struct FCounterScope
+	{
+		FORCEINLINE explicit FCounterScope(uint32 InFunctionId)
+			: FunctionId(InFunctionId)
+			, StartCycles(AUTO_TRACE_READ_CYCLES())
+		{
+		}
+
+		FORCEINLINE ~FCounterScope()
+		{
+			const uint64 EndCycles = AUTO_TRACE_READ_CYCLES();
+			FCounterSlot* Slots = ThreadCounterSlots != nullptr ? ThreadCounterSlots : RegisterCounterThread();
+			FCounterSlot& Slot = Slots[FunctionId];
+			++Slot.Calls;
+			Slot.Cycles += EndCycles - StartCycles;
+		}
+
+		uint32 FunctionId;
+		uint64 StartCycles;
+	};
+
+	// Merges every thread's slots and writes Name,File,Line,Calls,Cycles,TotalMs,AvgNs.
+	bool DumpCounters(const FString& Filename);
+	void ResetCounters();
+#endif
+}
+
+#if AUTO_TRACE_ENABLED
+#define AUTO_TRACE_SCOPE_ID(FunctionId) {Namespace}::FIdScope PREPROCESSOR_JOIN(__AutoTraceScope, __LINE__)(FunctionId)
+#define AUTO_TRACE_SCOPE_GATED(FunctionId) {Namespace}::FGatedScope PREPROCESSOR_JOIN(__AutoTraceScope, __LINE__)(FunctionId)
+#define AUTO_TRACE_SCOPE_SAMPLED(FunctionId, SampleEvery) \
+	static thread_local uint32 PREPROCESSOR_JOIN(__AutoTraceCountdown, __LINE__) = 0; \
+	{Namespace}::FSampledScope PREPROCESSOR_JOIN(__AutoTraceScope, __LINE__)(FunctionId, PREPROCESSOR_JOIN(__AutoTraceCountdown, __LINE__), SampleEvery)
+#define AUTO_TRACE_SCOPE_OUTERMOST(FunctionId) \
+	static thread_local uint32 PREPROCESSOR_JOIN(__AutoTraceDepth, __LINE__) = 0; \
+	{Namespace}::FOutermostScope PREPROCESSOR_JOIN(__AutoTraceScope, __LINE__)(FunctionId, PREPROCESSOR_JOIN(__AutoTraceDepth, __LINE__))
+#else
+#define AUTO_TRACE_SCOPE_ID(FunctionId)
+#define AUTO_TRACE_SCOPE_GATED(FunctionId)
+#define AUTO_TRACE_SCOPE_SAMPLED(FunctionId, SampleEvery)
+#define AUTO_TRACE_SCOPE_OUTERMOST(FunctionId)
+#endif
+
+#if AUTO_TRACE_COUNTERS_ENABLED
+#define AUTO_TRACE_COUNTER_SCOPE(FunctionId) {Namespace}::FCounterScope PREPROCESSOR_JOIN(__AutoTraceScope, __LINE__)(FunctionId)
+#else
+#define AUTO_TRACE_COUNTER_SCOPE(FunctionId)
+#endif
+)";
+
+// 生成的源文件模板
+static const char* generated_source_template = R"(// Generated by AutoInsertTrace, do not edit.
+#include "{Header}"
+#include "HAL/IConsoleManager.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+#include "Misc/ScopeLock.h"
+
+namespace {Namespace}
+{
+	const uint32 FunctionCount = {FunctionCount};
+
+	const FFunctionInfo Functions[] =
+	{
+{Functions}		{ nullptr, nullptr, 0 }
+	};
+
+	uint64 EnableBits[] = { {EnableBits} };
+
+#if AUTO_TRACE_ENABLED
+	uint32 SpecIds[{FunctionCount} + 1] = {};
+
+	uint32 RegisterSpecId(uint32 FunctionId)
+	{
+		const FFunctionInfo& Info = Functions[FunctionId];
+		SpecIds[FunctionId] = FCpuProfilerTrace::OutputEventType(Info.Name, Info.File, Info.Line);
+		return SpecIds[FunctionId];
+	}
+#endif
+
+#if AUTO_TRACE_COUNTERS_ENABLED
+	struct FCounterThread
+	{
+		FCounterThread* Next;
+		FCounterSlot* Slots;
+	};
+
+	thread_local FCounterSlot* ThreadCounterSlots = nullptr;
+
+	static FCriticalSection CounterThreadsLock;
+	static FCounterThread* CounterThreads = nullptr;
+	static uint64 CounterStartCycles = 0;
+	static double CounterStartSeconds = 0.0;
+
+	FCounterSlot* RegisterCounterThread()
+	{
+		SIZE_T SlotsSize = Align(sizeof(FCounterSlot) * FMath::Max<uint32>(FunctionCount, 1), PLATFORM_CACHE_LINE_SIZE);
+		FCounterSlot* Slots = static_cast<FCounterSlot*>(FMemory::MallocZeroed(SlotsSize, PLATFORM_CACHE_LINE_SIZE));
+		FScopeLock Lock(&CounterThreadsLock);
+		if (CounterThreads == nullptr)
+		{
+			CounterStartCycles = AUTO_TRACE_READ_CYCLES();
+			CounterStartSeconds = FPlatformTime::Seconds();
+		}
+		CounterThreads = new FCounterThread{ CounterThreads, Slots };
+		ThreadCounterSlots = Slots;
+		return Slots;
+	}
+
+	bool DumpCounters(const FString& Filename)
+	{
+		TArray<uint64> Calls;
+		TArray<uint64> Cycles;
+		Calls.SetNumZeroed(FunctionCount);
+		Cycles.SetNumZeroed(FunctionCount);
+		double CyclesPerSecond = 0.0;
+		{
+			FScopeLock Lock(&CounterThreadsLock);
+			for (FCounterThread* Thread = CounterThreads; Thread != nullptr; Thread = Thread->Next)
+			{
+				for (uint32 FunctionId = 0; FunctionId < FunctionCount; ++FunctionId)
+				{
+					Calls[FunctionId] += Thread->Slots[FunctionId].Calls;
+					Cycles[FunctionId] += Thread->Slots[FunctionId].Cycles;
+				}
+			}
+			const double ElapsedSeconds = FPlatformTime::Seconds() - CounterStartSeconds;
+			if (CounterThreads != nullptr && ElapsedSeconds > 0.0)
+			{
+				CyclesPerSecond = double(AUTO_TRACE_READ_CYCLES() - CounterStartCycles) / ElapsedSeconds;
+			}
+		}
+
+		FString Csv = TEXT("Name,File,Line,Calls,Cycles,TotalMs,AvgNs\n");
+		for (uint32 FunctionId = 0; FunctionId < FunctionCount; ++FunctionId)
+		{
+			if (Calls[FunctionId] == 0)
+			{
+				continue;
+			}
+			const double TotalSeconds = CyclesPerSecond > 0.0 ? double(Cycles[FunctionId]) / CyclesPerSecond : 0.0;
+			Csv += FString::Printf(TEXT("\"%s\",%s,%u,%llu,%llu,%.3f,%.1f\n"),
+				ANSI_TO_TCHAR(Functions[FunctionId].Name), ANSI_TO_TCHAR(Functions[FunctionId].File), Functions[FunctionId].Line,
+				Calls[FunctionId], Cycles[FunctionId], TotalSeconds * 1e3, TotalSeconds * 1e9 / double(Calls[FunctionId]));
+		}
+		return FFileHelper::SaveStringToFile(Csv, *Filename);
+	}
+
+	void ResetCounters()
+	{
+		FScopeLock Lock(&CounterThreadsLock);
+		for (FCounterThread* Thread = CounterThreads; Thread != nullptr; Thread = Thread->Next)
+		{
+			FMemory::Memzero(Thread->Slots, sizeof(FCounterSlot) * FunctionCount);
+		}
+	}
+
+	static FAutoConsoleCommand DumpCountersCommand(
+		TEXT("AutoTrace.{Module}.DumpCounters"),
+		TEXT("Write per-function call counts and times of counter scopes to a csv (default: Saved/Profiling/AutoTraceCounters_{Module}.csv)."),
+		FConsoleCommandWithArgsDelegate::CreateLambda([](const TArray<FString>& Args)
+		{
+			const FString Filename = Args.Num() > 0 ? Args[0] : FPaths::ProfilingDir() / TEXT("AutoTraceCounters_{Module}.csv");
+			UE_LOG(LogConsoleResponse, Display, TEXT("AutoTrace.{Module}: %s %s"), DumpCounters(Filename) ? TEXT("wrote") : TEXT("failed to write"), *Filename);
+		}));
+
+	static FAutoConsoleCommand ResetCountersCommand(
+		TEXT("AutoTrace.{Module}.ResetCounters"),
+		TEXT("Reset the counters of counter scopes."),
+		FConsoleCommandDelegate::CreateStatic(&ResetCounters));
+#endif
+
+	// Wildcards match function names, e.g. "SWidget::*" or "*Paint". No argument matches everything.
+	static void SetEnabled(const TArray<FString>& Args, bool bEnable)
+	{
+		int32 Changed = 0;
+		for (uint32 FunctionId = 0; FunctionId < FunctionCount; ++FunctionId)
+		{
+			const FString Name(Functions[FunctionId].Name);
+			bool bMatch = Args.Num() == 0;
+			for (const FString& Pattern : Args)
+			{
+				bMatch = bMatch || Name.MatchesWildcard(Pattern);
+			}
+			if (bMatch)
+			{
+				uint64& Word = EnableBits[FunctionId >> 6];
+				const uint64 Mask = uint64(1) << (FunctionId & 63);
+				Word = bEnable ? (Word | Mask) : (Word & ~Mask);
+				++Changed;
+			}
+		}
+		UE_LOG(LogConsoleResponse, Display, TEXT("AutoTrace.{Module}: %s %d functions"), bEnable ? TEXT("enabled") : TEXT("disabled"), Changed);
+	}
+
+	static FAutoConsoleCommand EnableCommand(
+		TEXT("AutoTrace.{Module}.Enable"),
+		TEXT("Enable auto-inserted trace scopes whose function name matches any of the wildcards (all if none)."),
+		FConsoleCommandWithArgsDelegate::CreateLambda([](const TArray<FString>& Args) { SetEnabled(Args, true); }));
+
+	static FAutoConsoleCommand DisableCommand(
+		TEXT("AutoTrace.{Module}.Disable"),
+		TEXT("Disable auto-inserted trace scopes whose function name matches any of the wildcards (all if none)."),
+		FConsoleCommandWithArgsDelegate::CreateLambda([](const TArray<FString>& Args) { SetEnabled(Args, false); }));
+}
+)";
+
+// 生成头文件和源文件: 函数ID -> 函数名/文件/行号的注册表、每个函数的开关位，以及按ID记录Trace事件的宏
+// 运行时热路径只需要按ID取出缓存的事件类型，不再处理函数名字符串
+void write_generated_files(const std::string& source_directory, const std::string& module_name, const FunctionRegistry& registry) {
+    std::string module_identifier = get_module_identifier(module_name);
+
+    std::string functions;
+    for (const auto& entry : registry.entries) {
+        functions += "\t\t{ " + escape_cpp_string(entry.name) + ", " + escape_cpp_string(entry.file) + ", " + std::to_string(entry.line) + " },\n";
+    }
+
+    // 默认所有函数都打开
+    std::string enable_bits;
+    size_t enable_words = std::max<size_t>(1, (registry.entries.size() + 63) / 64);
+    for (size_t i = 0; i < enable_words; i++) {
+        enable_bits += i == 0 ? "~uint64(0)" : ", ~uint64(0)";
+    }
+
+    std::string header = generated_header_template;
+    replace_all(header, "{Namespace}", "AutoTrace_" + module_identifier);
+
+    std::string source = generated_source_template;
+    replace_all(source, "{Header}", generated_header_name);
+    replace_all(source, "{Namespace}", "AutoTrace_" + module_identifier);
+    replace_all(source, "{Module}", module_identifier);
+    replace_all(source, "{FunctionCount}", std::to_string(registry.entries.size()));
+    replace_all(source, "{Functions}", functions);
+    replace_all(source, "{EnableBits}", enable_bits);
+
+    // 内容没有变化不重写，避免触发重新编译
+    std::filesystem::path header_path = std::filesystem::path(source_directory) / generated_header_name;
+    std::filesystem::path source_path = std::filesystem::path(source_directory) / generated_source_name;
+    std::string existing;
+    if (!read_file_bytes(header_path, existing) || existing != header) {
+        write_file_bytes(header_path, header);
+    }
+    if (!read_file_bytes(source_path, existing) || existing != source) {
+        write_file_bytes(source_path, source);
+    }
+}
+
+// 开关宏的头文件，AUTO_TRACE_ENABLED和按函数ID插入的头文件共用
+static const char* generated_switch_header = R"(// Generated by AutoInsertTrace, do not edit.
+#pragma once
+
+#include "CoreMinimal.h"
+#include "ProfilingDebugging/CpuProfilerTrace.h"
+
+// Master switch: define AUTO_TRACE_ENABLED=0 to compile out every auto-inserted trace scope.
+#ifndef AUTO_TRACE_ENABLED
+#define AUTO_TRACE_ENABLED CPUPROFILERTRACE_ENABLED
+#endif
+
+#if AUTO_TRACE_ENABLED
+#define AUTO_TRACE_SCOPE(Name) TRACE_CPUPROFILER_EVENT_SCOPE_WHEN_TRACING(Name)
+#else
+#define AUTO_TRACE_SCOPE(Name)
+#endif
+)";
+
+// 写入开关宏的头文件，内容没有变化不重写
+void write_switch_header(const std::string& source_directory) {
+    std::filesystem::path header_path = std::filesystem::path(source_directory) / generated_switch_header_name;
+    std::string existing;
+    if (!read_file_bytes(header_path, existing) || existing != generated_switch_header) {
+        write_file_bytes(header_path, generated_switch_header);
+    }
+}
+
+// 读取忽略列表
+std::unordered_map<std::string, std::unordered_set<std::string>> read_ignore_list(const std::string& filename) {
+    std::unordered_map<std::string, std::unordered_set<std::string>> ignore_list;
+    std::ifstream file(filename);
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream iss(line);
+        std::string file_name, function_name;
+        if (!(iss >> file_name >> function_name)) { continue; } // 空行或格式不对的行，后面追加的规则还要读
+        std::string rule_option;
+        if (iss >> rule_option) { continue; } // 带选项的是其他规则，比如采样
+        ignore_list[file_name].insert(function_name);
+    }
+    return ignore_list;
+}
+
+/**
+ * \brief 读取规则文件中带选项的规则，格式: 文件名 函数名 选项[=N]，例如 sample=16、loops
+ * \param min_value N小于这个值的规则无效
+ * \return 文件名 -> 函数名 -> N，没有=N时为0
+ */
+std::unordered_map<std::string, std::unordered_map<std::string, uint32_t>> read_function_rules(const std::string& filename, const std::string& option_name, uint32_t min_value) {
+    std::unordered_map<std::string, std::unordered_map<std::string, uint32_t>> function_rules;
+    std::ifstream file(filename);
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream iss(line);
+        std::string file_name, function_name, rule_option;
+        if (!(iss >> file_name >> function_name >> rule_option) || rule_option.compare(0, option_name.size(), option_name) != 0) {
+            continue;
+        }
+        uint32_t value = 0;
+        if (rule_option.size() > option_name.size()) {
+            if (rule_option[option_name.size()] != '=') {
+                continue;
+            }
+            value = static_cast<uint32_t>(strtoul(rule_option.c_str() + option_name.size() + 1, nullptr, 10));
+        }
+        if (value < min_value) {
+            std::cout << "\033[1;31m" << "invalid " << option_name << " rule: " << line << "\033[0m\n";
+            continue;
+        }
+        function_rules[file_name][function_name] = value;
+    }
+    return function_rules;
+}
+
+// 把*和?通配符转换成正则表达式
+std::regex wildcard_to_regex(const std::string& wildcard) {
+    std::string pattern;
+    for (char c : wildcard) {
+        if (c == '*') {
+            pattern += ".*";
+        } else if (c == '?') {
+            pattern += '.';
+        } else if (isalnum(static_cast<unsigned char>(c)) || c == '_') {
+            pattern += c;
+        } else {
+            pattern += '\\';
+            pattern += c;
+        }
+    }
+    return std::regex(pattern, std::regex::optimize);
+}
+
+// 迁移时查找的已有计时宏
+static const std::vector<std::string> migrate_macro_names = {
+    "TRACE_CPUPROFILER_EVENT_SCOPE",
+    "TRACE_CPUPROFILER_EVENT_SCOPE_STR",
+    "TRACE_CPUPROFILER_EVENT_SCOPE_TEXT",
+    "TRACE_CPUPROFILER_EVENT_SCOPE_ON_CHANNEL",
+    "TRACE_CPUPROFILER_EVENT_SCOPE_TEXT_ON_CHANNEL",
+    "SCOPE_CYCLE_COUNTER",
+    "QUICK_SCOPE_CYCLE_COUNTER",
+};
+
+/**
+ * \brief 读取宏规则，每行: 路径 类名 函数名 宏模板，前三个用*和?通配符，#开头是注释
+ * 宏模板可用 {Name} 完整函数名、{Short} 函数名最后一段、{Class} 类名、{File} 文件名、{Line} 行号、{Id} 函数ID，
+ * 模板为none表示不插入，例如:
+ *   * * On*Paint TRACE_CPUPROFILER_EVENT_SCOPE({Name})
+ *   * S*Input* On*Key* AUTO_TRACE_SCOPE_GATED({Id})
+ *   * * Get* none
+ * 模板中的宏不是本工具的宏，可能也有手写的，按规则插入的Trace总是带trace_marker，去除时只去除带标记的
+ * 模板中的宏名记录到rule_macro_names，只用来判断函数开头是否已经有这个宏，避免重复插入
+ */
+std::vector<MacroRule> read_macro_rules(const std::string& filename, std::vector<std::string>& rule_macro_names) {
+    std::vector<MacroRule> rules;
+    std::ifstream file(filename);
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream iss(line);
+        std::string path_pattern, class_pattern, function_pattern, macro_template;
+        if (!(iss >> path_pattern) || path_pattern[0] == '#') {
+            continue;
+        }
+        if (!(iss >> class_pattern >> function_pattern) || !std::getline(iss >> std::ws, macro_template) || macro_template.empty()) {
+            std::cout << "\033[1;31m" << "invalid macro rule: " << line << "\033[0m\n";
+            continue;
+        }
+        MacroRule rule;
+        rule.path_pattern = wildcard_to_regex(path_pattern);
+        rule.class_pattern = wildcard_to_regex(class_pattern);
+        rule.function_pattern = wildcard_to_regex(function_pattern);
+        rule.macro_template = macro_template == "none" ? "" : macro_template;
+        rule.text = line;
+        rules.push_back(rule);
+
+        std::string macro_name = rule.macro_template.substr(0, rule.macro_template.find('('));
+        if (!macro_name.empty() && std::find(rule_macro_names.begin(), rule_macro_names.end(), macro_name) == rule_macro_names.end()) {
+            rule_macro_names.push_back(macro_name);
+            if (std::find(migrate_macro_names.begin(), migrate_macro_names.end(), macro_name) != migrate_macro_names.end()) {
+                std::cout << "\033[1;31m" << "macro rule uses " << macro_name << ", which is also written by hand: only scopes marked with "
+                          << trace_marker << " are treated as inserted" << "\033[0m\n";
+            }
+        }
+    }
+    return rules;
+}
+
+// 查找第一条匹配的宏规则，没有匹配返回空指针
+const MacroRule* find_macro_rule(const std::vector<MacroRule>& rules, const std::string& relative_path, const std::string& class_name, const std::string& short_name) {
+    for (const auto& rule : rules) {
+        if (std::regex_match(relative_path, rule.path_pattern) && std::regex_match(class_name, rule.class_pattern) && std::regex_match(short_name, rule.function_pattern)) {
+            return &rule;
+        }
+    }
+    return nullptr;
+}
+
+// 获取函数所属的类名: 限定名的前面部分，类内定义时取外层class/struct的名字
+std::string get_function_class_name(TSNode node, const std::string& source_code, const std::string& function_name) {
+    size_t separator = function_name.rfind("::");
+    if (separator != std::string::npos) {
+        return function_name.substr(0, separator);
+    }
+    for (TSNode parent = ts_node_parent(node); ts_node_is_null(parent) == false; parent = ts_node_parent(parent)) {
+        const char* type = ts_node_type(parent);
+        if (strcmp(type, "class_specifier") == 0 || strcmp(type, "struct_specifier") == 0) {
+            TSNode name_node = ts_node_child_by_field_name(parent, "name", strlen("name"));
+            if (ts_node_is_null(name_node) == false) {
+                return source_code.substr(ts_node_start_byte(name_node), ts_node_end_byte(name_node) - ts_node_start_byte(name_node));
+            }
+        }
+    }
+    return "";
+}
+
+// 获取对某个文件生效的带选项规则，文件名为*的规则对所有文件生效，文件自己的规则优先
+std::unordered_map<std::string, uint32_t> get_function_rule_list(const std::unordered_map<std::string, std::unordered_map<std::string, uint32_t>>& function_rules, const std::string& file_path) {
+    std::unordered_map<std::string, uint32_t> function_rule_list;
+    std::string cpp_filename = std::filesystem::path(file_path).filename().string();
+    auto file_it = function_rules.find(cpp_filename);
+    if (file_it != function_rules.end()) {
+        function_rule_list = file_it->second;
+    }
+    auto all_it = function_rules.find("*");
+    if (all_it != function_rules.end()) {
+        function_rule_list.insert(all_it->second.begin(), all_it->second.end());
+    }
+    return function_rule_list;
+}
+
+// 获取对某个文件生效的忽略函数，文件名为*的规则对所有文件生效
+std::unordered_set<std::string> get_ignore_function_list(const std::unordered_map<std::string, std::unordered_set<std::string>>& ignore_list, const std::string& file_path) {
+    std::unordered_set<std::string> ignore_function_list;
+    std::string cpp_filename = std::filesystem::path(file_path).filename().string();
+    auto file_it = ignore_list.find(cpp_filename);
+    if (file_it != ignore_list.end()) {
+        ignore_function_list = file_it->second;
+    }
+    auto all_it = ignore_list.find("*");
+    if (all_it != ignore_list.end()) {
+        ignore_function_list.insert(all_it->second.begin(), all_it->second.end());
+    }
+    return ignore_function_list;
+}
+
+// 按性能数据裁剪的参数
+struct ProfilePruneOptions {
+    // 性能数据中时间的单位换算成秒的倍数，Unreal Insights导出的是秒
+    double time_unit_seconds = 1.0;
+    // 平均每次调用耗时低于这个值(微秒)的函数去掉
+    double min_microseconds_per_call = 1.0;
+    // 每帧调用次数超过这个值的函数去掉，0表示不限制
+    double max_calls_per_frame = 0.0;
+    // 性能数据包含的帧数
+    double frames = 1.0;
+    // 包含时间达到最大包含时间这个百分比的函数始终保留
+    double keep_inclusive_percent = 1.0;
+};
+
+// 性能数据中的一个函数
+struct ProfileTimer {
+    std::string name;
+    double count = 0.0;
+    double inclusive = 0.0;
+    double exclusive = 0.0;
+};
+
+// 拆分一行CSV，支持双引号包起来的字段
+std::vector<std::string> split_csv_line(const std::string& line) {
+    std::vector<std::string> fields(1);
+    bool quoted = false;
+    for (size_t i = 0; i < line.size(); i++) {
+        char c = line[i];
+        if (c == '"') {
+            if (quoted && i + 1 < line.size() && line[i + 1] == '"') {
+                fields.back() += '"';
+                i++;
+            } else {
+                quoted = !quoted;
+            }
+        } else if (c == ',' && !quoted) {
+            fields.emplace_back();
+        } else if (c != '\r') {
+            fields.back() += c;
+        }
+    }
+    return fields;
+}
+
+// 读取计时导出的CSV: 函数名,调用次数,包含时间,独占时间
+// 有表头时按列名查找(Name/Count/Incl/Excl)，否则按这个顺序
+std::vector<ProfileTimer> read_timing_csv(const std::string& filename) {
+    std::vector<ProfileTimer> timers;
+    std::ifstream file(filename);
+    std::string line;
+    size_t name_column = 0, count_column = 1, inclusive_column = 2, exclusive_column = 3;
+    bool first_line = true;
+    while (std::getline(file, line)) {
+        std::vector<std::string> fields = split_csv_line(line);
+        if (first_line) {
+            first_line = false;
+            bool has_header = false;
+            for (size_t i = 0; i < fields.size(); i++) {
+                std::string column = fields[i];
+                std::transform(column.begin(), column.end(), column.begin(), [](unsigned char c) { return static_cast<char>(tolower(c)); });
+                if (column == "name") {
+                    name_column = i;
+                    has_header = true;
+                } else if (column == "count") {
+                    count_column = i;
+                    has_header = true;
+                } else if (column == "incl" || column == "inclusive" || column == "inclusive time") {
+                    inclusive_column = i;
+                    has_header = true;
+                } else if (column == "excl" || column == "exclusive" || column == "exclusive time") {
+                    exclusive_column = i;
+                    has_header = true;
+                }
+            }
+            if (has_header) {
+                continue;
+            }
+        }
+        size_t required = std::max(std::max(name_column, count_column), std::max(inclusive_column, exclusive_column));
+        if (fields.size() <= required) {
+            continue;
+        }
+        ProfileTimer timer;
+        timer.name = fields[name_column];
+        timer.count = std::strtod(fields[count_column].c_str(), nullptr);
+        timer.inclusive = std::strtod(fields[inclusive_column].c_str(), nullptr);
+        timer.exclusive = std::strtod(fields[exclusive_column].c_str(), nullptr);
+        if (!timer.name.empty() && timer.count > 0) {
+            timers.push_back(timer);
+        }
+    }
+    return timers;
+}
+
+// 按上次Trace的性能数据裁剪: 平均耗时太短或者调用太频繁的函数写入忽略列表(对所有文件生效)
+// 包含时间占比大的函数始终保留。返回新增的忽略规则数量
+size_t prune_by_profile(const std::string& csv_filename, const ProfilePruneOptions& prune_options, const std::string& ignore_list_filename,
+                        std::unordered_map<std::string, std::unordered_set<std::string>>& ignore_list, std::ofstream& log_file) {
+    std::vector<ProfileTimer> timers = read_timing_csv(csv_filename);
+    if (timers.empty()) {
+        PRINT_MSG_RED("no timers in " << csv_filename)
+        return 0;
+    }
+
+    double max_inclusive = 0.0;
+    for (const auto& timer : timers) {
+        max_inclusive = std::max(max_inclusive, timer.inclusive);
+    }
+
+    // 忽略列表最后没有换行时先补一个换行
+    bool needs_newline = false;
+    {
+        std::ifstream existing(ignore_list_filename, std::ios::binary | std::ios::ate);
+        if (existing && existing.tellg() > 0) {
+            existing.seekg(-1, std::ios::end);
+            needs_newline = existing.get() != '\n';
+        }
+    }
+    std::ofstream ignore_file(ignore_list_filename, std::ios::binary | std::ios::app);
+    if (needs_newline) {
+        ignore_file << '\n';
+    }
+
+    size_t pruned = 0;
+    for (const auto& timer : timers) {
+        // Trace宏的参数就是函数名，没有空白字符的才可能是插入的函数
+        if (timer.name.find_first_of(" \t") != std::string::npos) {
+            continue;
+        }
+        if (timer.inclusive >= max_inclusive * prune_options.keep_inclusive_percent / 100.0) {
+            continue;
+        }
+
+        double microseconds_per_call = timer.inclusive * prune_options.time_unit_seconds * 1e6 / timer.count;
+        double calls_per_frame = timer.count / std::max(prune_options.frames, 1.0);
+        std::string reason;
+        if (microseconds_per_call < prune_options.min_microseconds_per_call) {
+            reason = "per-call " + std::to_string(microseconds_per_call) + "us";
+        } else if (prune_options.max_calls_per_frame > 0 && calls_per_frame > prune_options.max_calls_per_frame) {
+            reason = "calls/frame " + std::to_string(calls_per_frame);
+        } else {
+            continue;
+        }
+
+        if (ignore_list["*"].insert(timer.name).second) {
+            ignore_file << "* " << timer.name << '\n';
+            pruned++;
+            PRINT_MSG("pruned " << timer.name << ": " << reason)
+        }
+    }
+    PRINT_MSG_GREEN("pruned by profile: " << pruned << " functions written to " << ignore_list_filename)
+    return pruned;
+}
+
+TSNode ts_node_child_by_node_type(TSNode node,const char* in_node_type)
+{
+	for(int i=0;i<ts_node_child_count(node);i++)
+    {
+        TSNode child_node = ts_node_child(node, i);
+        const char* node_type = ts_node_type(child_node);
+        if (strcmp(node_type, in_node_type) == 0)
+        {
+	        return child_node;
+        }
+    }
+    return TSNode();
+}
+
+TSNode ts_find_node_by_type(TSNode node, const char* node_type) {
+    // 获取当前节点的类型
+    const char* type = ts_node_type(node);
+
+    // 检查当前节点的类型是否是指定的类型
+    if (strcmp(type, node_type) == 0) {
+        return node;
+    }
+
+    // 遍历所有子节点
+    uint32_t child_count = ts_node_named_child_count(node);
+    for (uint32_t i = 0; i < child_count; i++) {
+        TSNode child_node = ts_node_named_child(node, i);
+        TSNode result = ts_find_node_by_type(child_node, node_type);
+
+        // 如果找到了指定类型的节点，返回它
+        if (ts_node_is_null(result) == 0) {
+            return result;
+        }
+    }
+
+    // 如果没有找到指定类型的节点，返回一个空节点
+    return TSNode();
+}
+
+TSNode ts_find_node_in_first_child_level_by_type(TSNode node, const char* node_type) {
+    // 遍历所有子节点
+    uint32_t child_count = ts_node_named_child_count(node);
+    for (uint32_t i = 0; i < child_count; i++) {
+        TSNode child_node = ts_node_named_child(node, i);
+        if (ts_node_is_null(child_node) == 1) {
+            continue;
+        }
+
+        // 获取当前节点的类型
+	    const char* child_node_type = ts_node_type(child_node);
+
+	    // 检查当前节点的类型是否是指定的类型
+	    if (strcmp(child_node_type, node_type) == 0) {
+	        return child_node;
+	    }
+    }
+
+    // 如果没有找到指定类型的节点，返回一个空节点
+    return TSNode();
+}
+
+bool ts_check_node_source_code(const std::string& source_code,TSNode node, const char* in_node_code) {
+    if(ts_node_is_null(node)==false)
+    {
+        std::string node_code = source_code.substr(ts_node_start_byte(node), ts_node_end_byte(node) - ts_node_start_byte(node));
+        if (in_node_code==node_code) {
+	        return true;
+	    }
+    }
+    return false;
+}
+
+// 函数声明是否是不抛异常的noexcept，noexcept(false)和noexcept(表达式)不算
+bool ts_is_noexcept_true(TSNode function_declarator_node, const std::string& source_code) {
+    TSNode noexcept_node = ts_find_node_in_first_child_level_by_type(function_declarator_node, "noexcept");
+    if (ts_node_is_null(noexcept_node)) {
+        return false;
+    }
+    if (ts_node_named_child_count(noexcept_node) == 0) {
+        return true;
+    }
+    TSNode argument_node = ts_node_named_child(noexcept_node, 0);
+    return ts_check_node_source_code(source_code, argument_node, "true") || ts_check_node_source_code(source_code, argument_node, "1");
+}
+
+// 统计节点下语句的数量(包括嵌套的语句，不包括复合语句本身)
+uint32_t ts_count_statements(TSNode node) {
+    uint32_t count = 0;
+    uint32_t child_count = ts_node_named_child_count(node);
+    for (uint32_t i = 0; i < child_count; i++) {
+        TSNode child_node = ts_node_named_child(node, i);
+        const char* type = ts_node_type(child_node);
+        size_t type_length = strlen(type);
+        bool is_statement = type_length > 10 && strcmp(type + type_length - 10, "_statement") == 0;
+        if ((is_statement && strcmp(type, "compound_statement") != 0) || strcmp(type, "declaration") == 0) {
+            count++;
+        }
+        count += ts_count_statements(child_node);
+    }
+    return count;
+}
+
+// 节点下是否有循环或者函数调用
+bool ts_has_loop_or_call(TSNode node) {
+    static const char* types[] = {"for_statement", "for_range_loop", "while_statement", "do_statement", "call_expression"};
+    for (const char* type : types) {
+        if (ts_node_is_null(ts_find_node_by_type(node, type)) == false) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 复合语句是否只有一条return语句
+bool ts_is_pure_return_body(TSNode compound_statement_node) {
+    TSNode statement_node = TSNode();
+    uint32_t child_count = ts_node_named_child_count(compound_statement_node);
+    for (uint32_t i = 0; i < child_count; i++) {
+        TSNode child_node = ts_node_named_child(compound_statement_node, i);
+        if (strcmp(ts_node_type(child_node), "comment") == 0) {
+            continue;
+        }
+        if (ts_node_is_null(statement_node) == false) {
+            return false;
+        }
+        statement_node = child_node;
+    }
+    return ts_node_is_null(statement_node) == false && strcmp(ts_node_type(statement_node), "return_statement") == 0;
+}
+
+// 表达式是否足够简单: 没有lambda，所有函数调用都没有参数(例如 IsEnabled()/FReply::Unhandled())
+bool ts_is_cheap_expression(TSNode node) {
+    const char* type = ts_node_type(node);
+    if (strcmp(type, "lambda_expression") == 0) {
+        return false;
+    }
+    if (strcmp(type, "call_expression") == 0) {
+        TSNode arguments_node = ts_node_child_by_field_name(node, "arguments", strlen("arguments"));
+        if (ts_node_is_null(arguments_node) == false && ts_node_named_child_count(arguments_node) > 0) {
+            return false;
+        }
+    }
+    uint32_t child_count = ts_node_named_child_count(node);
+    for (uint32_t i = 0; i < child_count; i++) {
+        if (!ts_is_cheap_expression(ts_node_named_child(node, i))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// 是否是函数开头的提前返回检查:
+//   if (简单条件) return 简单表达式; / continue; 以及只包含它们的复合语句
+//   check/checkf/checkSlow/ensure/ensureMsgf/ensureAlways/verify/verifyf(简单条件);
+bool ts_is_guard_statement(TSNode node, const std::string& source_code) {
+    const char* type = ts_node_type(node);
+    if (strcmp(type, "if_statement") == 0) {
+        if (ts_node_is_null(ts_node_child_by_field_name(node, "alternative", strlen("alternative"))) == false) {
+            return false;
+        }
+        TSNode condition_node = ts_node_child_by_field_name(node, "condition", strlen("condition"));
+        TSNode consequence_node = ts_node_child_by_field_name(node, "consequence", strlen("consequence"));
+        if (ts_node_is_null(condition_node) || ts_node_is_null(consequence_node) || !ts_is_cheap_expression(condition_node)) {
+            return false;
+        }
+        if (strcmp(ts_node_type(consequence_node), "compound_statement") == 0) {
+            if (ts_node_named_child_count(consequence_node) != 1) {
+                return false;
+            }
+            consequence_node = ts_node_named_child(consequence_node, 0);
+        }
+        const char* consequence_type = ts_node_type(consequence_node);
+        return (strcmp(consequence_type, "return_statement") == 0 || strcmp(consequence_type, "continue_statement") == 0)
+            && ts_is_cheap_expression(consequence_node);
+    }
+    if (strcmp(type, "expression_statement") == 0 && ts_node_named_child_count(node) == 1) {
+        TSNode call_node = ts_node_named_child(node, 0);
+        if (strcmp(ts_node_type(call_node), "call_expression") != 0) {
+            return false;
+        }
+        static const std::unordered_set<std::string> guard_macros = {"check", "checkf", "checkSlow", "ensure", "ensureMsgf", "ensureAlways", "ensureAlwaysMsgf", "verify", "verifyf"};
+        TSNode callee_node = ts_node_child_by_field_name(call_node, "function", strlen("function"));
+        TSNode arguments_node = ts_node_child_by_field_name(call_node, "arguments", strlen("arguments"));
+        if (ts_node_is_null(callee_node) || ts_node_is_null(arguments_node)) {
+            return false;
+        }
+        std::string callee = source_code.substr(ts_node_start_byte(callee_node), ts_node_end_byte(callee_node) - ts_node_start_byte(callee_node));
+        return guard_macros.count(callee) > 0 && ts_is_cheap_expression(arguments_node);
+    }
+    return false;
+}
+
+TSNode ts_find_error_node(TSNode node) {
+    const char* node_type = ts_node_type(node);
+    if (strcmp(node_type, "ERROR") == 0) {
+        return node;
+    }
+
+    uint32_t child_count = ts_node_child_count(node);
+    for (uint32_t i = 0; i < child_count; i++) {
+        TSNode child = ts_node_child(node, i);
+        TSNode error_node = ts_find_error_node(child);
+        if (ts_node_is_null(error_node)==false && strcmp(ts_node_type(error_node), "ERROR") == 0) {
+            return error_node;
+        }
+    }
+
+    // Return an empty node if no error node was found
+    return TSNode();
+}
+
+
+/**
+ * \brief 检查pos处是否是一条插入的Trace语句: 宏名(...); 以及可选的标记
+ * \return Trace语句结束的位置，不是Trace语句返回npos
+ */
+size_t match_trace_statement(const std::string& source_code, size_t pos) {
+    // 宏名后面必须紧跟(，AUTO_TRACE_SCOPE是AUTO_TRACE_SCOPE_ID的前缀
+    size_t macro_length = 0;
+    for (const auto& macro_name : auto_trace_macro_names) {
+        size_t name_end = pos + macro_name.size();
+        if (source_code.compare(pos, macro_name.size(), macro_name) == 0 && name_end < source_code.size() && source_code[name_end] == '(') {
+            macro_length = macro_name.size();
+            break;
+        }
+    }
+    // 其他宏(宏规则插入的)必须带标记才算插入的
+    bool require_marker = false;
+    if (macro_length == 0) {
+        size_t name_end = pos;
+        while (name_end < source_code.size() && (isalnum(static_cast<unsigned char>(source_code[name_end])) || source_code[name_end] == '_')) {
+            name_end++;
+        }
+        if (name_end == pos || isdigit(static_cast<unsigned char>(source_code[pos])) || name_end >= source_code.size() || source_code[name_end] != '(') {
+            return std::string::npos;
+        }
+        macro_length = name_end - pos;
+        require_marker = true;
+    }
+    size_t cursor = pos + macro_length;
+
+    // 查找匹配的右括号
+    int depth = 0;
+    for (; cursor < source_code.size(); cursor++) {
+        char c = source_code[cursor];
+        if (c == '\n') {
+            return std::string::npos;
+        }
+        if (c == '(') {
+            depth++;
+        } else if (c == ')' && --depth == 0) {
+            break;
+        }
+    }
+    if (cursor + 1 >= source_code.size() || source_code[cursor + 1] != ';') {
+        return std::string::npos;
+    }
+    cursor += 2;
+
+    if (source_code.compare(cursor, migrated_marker.size(), migrated_marker) == 0) {
+        return std::string::npos;
+    }
+    if (source_code.compare(cursor, trace_marker.size(), trace_marker) == 0) {
+        cursor += trace_marker.size();
+    } else if (require_marker) {
+        return std::string::npos;
+    }
+    return cursor;
+}
+
+/**
+ * \brief 在函数体开头(可以在提前返回检查之后)查找插入的Trace语句
+ * \return Trace语句开始的位置，没有返回npos
+ */
+size_t find_leading_trace_statement(TSNode compound_statement_node, const std::string& source_code) {
+    uint32_t child_count = ts_node_child_count(compound_statement_node);
+    for (uint32_t i = 1; i < child_count; i++) {
+        TSNode child_node = ts_node_child(compound_statement_node, i);
+        size_t child_start = ts_node_start_byte(child_node);
+        if (match_trace_statement(source_code, child_start) != std::string::npos) {
+            return child_start;
+        }
+        if (strcmp(ts_node_type(child_node), "comment") != 0 && !ts_is_guard_statement(child_node, source_code)) {
+            break;
+        }
+    }
+    return std::string::npos;
+}
+
+/**
+ * \brief 去除pos处插入的Trace语句，连同插入时复制的空白字符
+ * 同行插入的Trace只去掉插入时加的一个空格: "TRACE(...); 语句" 或者 "{ TRACE(...);" 在行尾(前面紧跟{、;或者})
+ */
+bool strip_trace_statement(const std::string& source_code, size_t pos, std::vector<TextEdit>& edits) {
+    size_t end = match_trace_statement(source_code, pos);
+    if (end == std::string::npos) {
+        return false;
+    }
+    if (end + 1 < source_code.size() && source_code[end] == ' ' && !isspace(static_cast<unsigned char>(source_code[end + 1]))) {
+        edits.push_back({pos, end + 1 - pos, ""});
+        return true;
+    }
+    // 默认插入时Trace后面复制的空白不会到行尾就结束，只有同行插入到下一条预处理指令前才是这种形式
+    size_t line_end = source_code.find('\n', end);
+    bool blank_to_line_end = source_code.find_first_not_of(" \t\r", end) >= (line_end == std::string::npos ? source_code.size() : line_end);
+    if (pos >= 2 && source_code[pos - 1] == ' ' && strchr("{;}", source_code[pos - 2]) != nullptr && blank_to_line_end) {
+        edits.push_back({pos - 1, end - pos + 1, ""});
+        return true;
+    }
+    while (end < source_code.size() && isspace(static_cast<unsigned char>(source_code[end]))) {
+        end++;
+    }
+    edits.push_back({pos, end - pos, ""});
+    return true;
+}
+
+/**
+ * \brief 生成在insert_before_node之前插入Trace的修改
+ * 默认在Trace后面复制一份blank_start到insert_before_node之间的空白，会增加行；
+ * same_line风格只加一个空格放在下一条语句同一行，下一条是预处理指令时放到前一个{或语句的行尾，行号不变
+ */
+TextEdit make_trace_insertion(const std::string& source_code, uint32_t blank_start, TSNode insert_before_node, const std::string& trace_line, const TraceOptions& options) {
+    uint32_t insert_start = ts_node_start_byte(insert_before_node);
+    if (options.same_line) {
+        if (strncmp(ts_node_type(insert_before_node), "preproc", 7) == 0) {
+            return {blank_start, 0, " " + trace_line};
+        }
+        return {insert_start, 0, trace_line + " "};
+    }
+    return {insert_start, 0, trace_line + source_code.substr(blank_start, insert_start - blank_start)};
+}
+
+/**
+ * \brief 检查插入的Trace能否被strip_trace_statement按字节原样去除
+ * 只取插入位置所在行到后面第一个非空白字符，不复制整个文件
+ */
+bool trace_insertion_round_trips(const std::string& source_code, const TextEdit& insertion) {
+    size_t line_start = source_code.rfind('\n', insertion.start == 0 ? 0 : insertion.start - 1);
+    line_start = line_start == std::string::npos || insertion.start == 0 ? 0 : line_start + 1;
+    size_t window_end = source_code.find_first_not_of(" \t\r\n", insertion.start);
+    window_end = window_end == std::string::npos ? source_code.size() : window_end + 1;
+    std::string original = source_code.substr(line_start, window_end - line_start);
+
+    std::string inserted = original;
+    size_t trace_pos = insertion.start - line_start;
+    inserted.insert(trace_pos, insertion.text);
+    // 同行插入到行尾时前面有一个空格
+    if (!insertion.text.empty() && insertion.text[0] == ' ') {
+        trace_pos++;
+    }
+    std::vector<TextEdit> edits;
+    if (!strip_trace_statement(inserted, trace_pos, edits)) {
+        return false;
+    }
+    apply_text_edits(inserted, edits);
+    return inserted == original;
+}
+
+
+/**
+ * \brief 获取语句开头的计时宏名: 宏名后面紧跟(，不是计时宏返回空
+ */
+std::string get_scope_macro_name(const std::string& statement_code) {
+    size_t name_end = 0;
+    while (name_end < statement_code.size() && (isalnum(static_cast<unsigned char>(statement_code[name_end])) || statement_code[name_end] == '_')) {
+        name_end++;
+    }
+    size_t paren = name_end;
+    while (paren < statement_code.size() && (statement_code[paren] == ' ' || statement_code[paren] == '\t')) {
+        paren++;
+    }
+    if (paren >= statement_code.size() || statement_code[paren] != '(') {
+        return "";
+    }
+    std::string name = statement_code.substr(0, name_end);
+    for (const auto& macro_name : auto_trace_macro_names) {
+        if (name == macro_name) {
+            return name;
+        }
+    }
+    for (const auto& macro_name : migrate_macro_names) {
+        if (name == macro_name) {
+            return name;
+        }
+    }
+    return "";
+}
+
+// 是否是代码块里的#if/#ifdef/#elif/#else分支，分支里的语句也属于这个代码块
+bool ts_is_preproc_branch(TSNode node) {
+    const char* type = ts_node_type(node);
+    return strcmp(type, "preproc_if") == 0 || strcmp(type, "preproc_ifdef") == 0 || strcmp(type, "preproc_elif") == 0
+        || strcmp(type, "preproc_elifdef") == 0 || strcmp(type, "preproc_else") == 0;
+}
+
+/**
+ * \brief 收集代码块里的计时宏语句，包括代码块里#if等分支中的语句，例如
+ *   #if WITH_VERY_VERBOSE_SLATE_STATS
+ *   SCOPE_CYCLE_COUNTER(STAT_ChildPaint);
+ *   #endif
+ */
+void collect_scope_statements(TSNode block_node, const std::string& source_code, std::vector<std::pair<TSNode, std::string>>& scope_statements) {
+    uint32_t child_count = ts_node_named_child_count(block_node);
+    for (uint32_t i = 0; i < child_count; i++) {
+        TSNode child_node = ts_node_named_child(block_node, i);
+        if (ts_is_preproc_branch(child_node)) {
+            collect_scope_statements(child_node, source_code, scope_statements);
+            continue;
+        }
+        std::string child_code = source_code.substr(ts_node_start_byte(child_node), ts_node_end_byte(child_node) - ts_node_start_byte(child_node));
+        std::string macro_name = get_scope_macro_name(child_code);
+        if (!macro_name.empty()) {
+            scope_statements.push_back({child_node, macro_name});
+        }
+    }
+}
+
+/**
+ * \brief 代码块里(不包括lambda和局部类)是否有迁移会修改的计时宏
+ */
+bool ts_has_migrate_scope(TSNode node, const std::string& source_code) {
+    if (strcmp(ts_node_type(node), "compound_statement") == 0) {
+        std::vector<std::pair<TSNode, std::string>> scope_statements;
+        collect_scope_statements(node, source_code, scope_statements);
+        for (const auto& scope_statement : scope_statements) {
+            const std::string& macro_name = scope_statement.second;
+            if (macro_name == "TRACE_CPUPROFILER_EVENT_SCOPE" || macro_name == "SCOPE_CYCLE_COUNTER" || macro_name == "QUICK_SCOPE_CYCLE_COUNTER") {
+                return true;
+            }
+        }
+    }
+    uint32_t child_count = ts_node_named_child_count(node);
+    for (uint32_t i = 0; i < child_count; i++) {
+        TSNode child_node = ts_node_named_child(node, i);
+        const char* type = ts_node_type(child_node);
+        if (strcmp(type, "lambda_expression") != 0 && strcmp(type, "class_specifier") != 0 && strcmp(type, "struct_specifier") != 0
+            && ts_has_migrate_scope(child_node, source_code)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * \brief 遍历语法树，把函数体中已有的TRACE_CPUPROFILER_EVENT_SCOPE和SCOPE_CYCLE_COUNTER改成_WHEN_TRACING版本
+ * 同一个代码块里同时有Stat和Trace时只迁移Trace，Stat保留并报告冲突；动态名字和指定通道的Trace不能迁移，只报告
+ * 迁移过的语句后面加上migrated_marker，去除插入的Trace时不会被当成插入的去掉
+ */
+void migrate_traverse(TSNode node, const std::string& source_code, std::vector<TextEdit>& edits, std::ofstream& log_file, TraceStats& stats) {
+    while (ts_node_is_null(node) == false) {
+        if (strcmp(ts_node_type(node), "compound_statement") == 0) {
+            // 先收集这个代码块里直接包含的计时宏，包括#if分支里的
+            std::vector<std::pair<TSNode, std::string>> scope_statements;
+            collect_scope_statements(node, source_code, scope_statements);
+            bool has_trace = false;
+            for (const auto& scope_statement : scope_statements) {
+                has_trace = has_trace || scope_statement.second.find("SCOPE_CYCLE_COUNTER") == std::string::npos;
+            }
+
+            for (const auto& scope_statement : scope_statements) {
+                const std::string& macro_name = scope_statement.second;
+                uint32_t start = ts_node_start_byte(scope_statement.first);
+                uint32_t line = ts_node_start_point(scope_statement.first).row + 1;
+                uint32_t end = ts_node_end_byte(scope_statement.first);
+                std::string statement_code = source_code.substr(start, end - start);
+                // 宏规则插入的Trace(后面有插入标记)留给--strip去除，迁移后就去除不掉了
+                if (source_code.compare(end, trace_marker.size(), trace_marker) == 0) {
+                    continue;
+                }
+                bool rewrite = false;
+                if (macro_name == "TRACE_CPUPROFILER_EVENT_SCOPE") {
+                    rewrite = true;
+                } else if (macro_name == "SCOPE_CYCLE_COUNTER" || macro_name == "QUICK_SCOPE_CYCLE_COUNTER") {
+                    if (has_trace) {
+                        PRINT_MSG_RED("migrate conflict, stat and trace scope in the same block, line " << line << ": " << statement_code)
+                        stats.migrate_conflicts++;
+                    } else {
+                        rewrite = true;
+                    }
+                } else if (std::find(migrate_macro_names.begin(), migrate_macro_names.end(), macro_name) != migrate_macro_names.end()) {
+                    PRINT_MSG_RED("migrate conflict, no _WHEN_TRACING variant, line " << line << ": " << statement_code)
+                    stats.migrate_conflicts++;
+                }
+                if (rewrite) {
+                    edits.push_back({start, macro_name.size(), trace_macro_name});
+                    if (end > start && source_code[end - 1] == ';') {
+                        edits.push_back({end, 0, migrated_marker});
+                    }
+                    stats.migrated++;
+                }
+            }
+        }
+
+        if (ts_node_child_count(node) > 0) {
+            migrate_traverse(ts_node_named_child(node, 0), source_code, edits, log_file, stats);
+        }
+        node = ts_node_next_named_sibling(node);
+    }
+}
+
+// 代码块里是否有co_await/co_yield/co_return，lambda里的不算
+bool ts_has_coroutine_keyword(TSNode node) {
+    uint32_t child_count = ts_node_child_count(node);
+    for (uint32_t i = 0; i < child_count; i++) {
+        TSNode child_node = ts_node_child(node, i);
+        const char* type = ts_node_type(child_node);
+        if (strcmp(type, "co_await") == 0 || strcmp(type, "co_yield") == 0 || strcmp(type, "co_return") == 0) {
+            return true;
+        }
+        if (strcmp(type, "lambda_expression") != 0 && ts_has_coroutine_keyword(child_node)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * \brief 遍历语法树，去除函数体、循环体、lambda开头插入的Trace语句
+ * 协程的代码块Trace可以插入到if/else、try和单独的{}里，所以协程函数里的所有代码块都要检查，其他函数里的手写Trace不会被去掉
+ */
+void strip_traverse(TSNode node, const std::string& source_code, std::vector<TextEdit>& edits, bool in_coroutine = false) {
+    while (ts_node_is_null(node) == false) {
+        bool child_in_coroutine = in_coroutine;
+        if (strcmp(ts_node_type(node), "function_definition") == 0 || strcmp(ts_node_type(node), "lambda_expression") == 0 || ts_is_loop_node(node)) {
+            TSNode compound_statement_node = ts_node_child_by_node_type(node, "compound_statement");
+            if (ts_node_is_null(compound_statement_node) == false) {
+                size_t trace_start = find_leading_trace_statement(compound_statement_node, source_code);
+                if (trace_start != std::string::npos) {
+                    strip_trace_statement(source_code, trace_start, edits);
+                }
+            }
+            if (strcmp(ts_node_type(node), "function_definition") == 0) {
+                child_in_coroutine = ts_node_is_null(compound_statement_node) == false && ts_has_coroutine_keyword(compound_statement_node);
+            } else if (strcmp(ts_node_type(node), "lambda_expression") == 0) {
+                child_in_coroutine = false;
+            }
+        } else if (in_coroutine && strcmp(ts_node_type(node), "compound_statement") == 0) {
+            // 函数体、循环体、lambda的代码块已经在上面处理过
+            TSNode parent_node = ts_node_parent(node);
+            if (strcmp(ts_node_type(parent_node), "function_definition") != 0 && strcmp(ts_node_type(parent_node), "lambda_expression") != 0 && !ts_is_loop_node(parent_node)) {
+                size_t trace_start = find_leading_trace_statement(node, source_code);
+                if (trace_start != std::string::npos) {
+                    strip_trace_statement(source_code, trace_start, edits);
+                }
+            }
+        }
+
+        if (ts_node_child_count(node) > 0) {
+            strip_traverse(ts_node_named_child(node, 0), source_code, edits, child_in_coroutine);
+        }
+        node = ts_node_next_named_sibling(node);
+    }
+}
+
+/**
+ * \brief 按标记直接查找插入的Trace语句并去除，不需要解析
+ */
+void strip_marked_traces(const std::string& source_code, std::vector<TextEdit>& edits) {
+    for (size_t marker_pos = source_code.find(trace_marker); marker_pos != std::string::npos; marker_pos = source_code.find(trace_marker, marker_pos + trace_marker.size())) {
+        size_t line_start = source_code.rfind('\n', marker_pos);
+        line_start = line_start == std::string::npos ? 0 : line_start + 1;
+        // 从行首开始找到以这个标记结束的Trace语句，宏规则插入的宏也能找到
+        for (size_t pos = line_start; pos < marker_pos; pos++) {
+            if (pos > line_start && (isalnum(static_cast<unsigned char>(source_code[pos - 1])) || source_code[pos - 1] == '_')) {
+                continue;
+            }
+            if (match_trace_statement(source_code, pos) == marker_pos + trace_marker.size() && strip_trace_statement(source_code, pos, edits)) {
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * \brief 查找文件中包含生成头文件header_name的那一行，没有返回npos
+ */
+size_t find_generated_include(const std::string& source_code, const std::string& header_name, size_t& line_end) {
+    std::string include_suffix = header_name + "\"";
+    for (size_t pos = source_code.find(include_suffix); pos != std::string::npos; pos = source_code.find(include_suffix, pos + 1)) {
+        size_t line_start = source_code.rfind('\n', pos);
+        line_start = line_start == std::string::npos ? 0 : line_start + 1;
+        if (source_code.compare(line_start, 10, "#include \"") != 0) {
+            continue;
+        }
+        // 文件名前面是路径分隔符或者引号，避免匹配到名字以header_name结尾的其他头文件
+        if (pos == 0 || (source_code[pos - 1] != '/' && source_code[pos - 1] != '"')) {
+            continue;
+        }
+        line_end = source_code.find('\n', pos);
+        line_end = line_end == std::string::npos ? source_code.size() : line_end + 1;
+        return line_start;
+    }
+    return std::string::npos;
+}
+
+/**
+ * \brief 去除插入的生成头文件包含
+ */
+void strip_generated_include(const std::string& source_code, std::vector<TextEdit>& edits) {
+    for (const auto& header_name : {generated_header_name, generated_switch_header_name}) {
+        size_t line_end = 0;
+        size_t line_start = find_generated_include(source_code, header_name, line_end);
+        if (line_start != std::string::npos) {
+            edits.push_back({line_start, line_end - line_start, ""});
+        }
+    }
+}
+
+/**
+ * \brief 修改中是否插入了macro_name的Trace，或者把已有的Trace改成了macro_name
+ */
+bool edits_insert_macro(const std::vector<TextEdit>& edits, const std::string& macro_name) {
+    for (const auto& edit : edits) {
+        if (edit.text == macro_name || edit.text.find(macro_name + "(") != std::string::npos) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * \brief 在最后一个顶层#include之后插入生成头文件header_name的包含，每个文件只插入一次
+ */
+void add_generated_include(TSNode root_node, const std::string& source_code, const std::string& file_path, const std::string& source_directory, const std::string& header_name, std::vector<TextEdit>& edits) {
+    size_t line_end = 0;
+    if (find_generated_include(source_code, header_name, line_end) != std::string::npos) {
+        return;
+    }
+
+    size_t insert_pos = 0;
+    uint32_t child_count = ts_node_named_child_count(root_node);
+    for (uint32_t i = 0; i < child_count; i++) {
+        TSNode child_node = ts_node_named_child(root_node, i);
+        if (strcmp(ts_node_type(child_node), "preproc_include") == 0) {
+            insert_pos = ts_node_end_byte(child_node);
+        }
+    }
+    // preproc_include包含行尾的换行，如果没有(文件最后一行)先补一个
+    std::string prefix = insert_pos > 0 && source_code[insert_pos - 1] != '\n' ? "\n" : "";
+
+    std::filesystem::path header_path = std::filesystem::path(source_directory) / header_name;
+    std::string include_path = std::filesystem::relative(header_path, std::filesystem::path(file_path).parent_path()).generic_string();
+    edits.push_back({insert_pos, 0, prefix + "#include \"" + include_path + "\"\n"});
+}
+
+// 获取function_definition的函数名，不是普通函数定义返回空
+std::string get_function_definition_name(TSNode node, const std::string& source_code) {
+    TSNode function_declarator_node = ts_find_node_in_first_child_level_by_type(node, "function_declarator");
+    if (ts_node_is_null(function_declarator_node)) {
+        return "";
+    }
+    TSNode function_name_node = ts_node_child_by_field_name(function_declarator_node, "declarator", strlen("declarator"));
+    if (ts_node_is_null(function_name_node)) {
+        return "";
+    }
+    return source_code.substr(ts_node_start_byte(function_name_node), ts_node_end_byte(function_name_node) - ts_node_start_byte(function_name_node));
+}
+
+// 收集函数体内的调用和调用点所在的循环嵌套层数
+void collect_call_sites(TSNode node, const std::string& source_code, const std::unordered_set<std::string>& scopes, uint32_t loop_depth, std::vector<std::pair<std::string, uint32_t>>& call_sites) {
+    uint32_t child_count = ts_node_named_child_count(node);
+    for (uint32_t i = 0; i < child_count; i++) {
+        TSNode child_node = ts_node_named_child(node, i);
+        uint32_t child_loop_depth = ts_is_loop_node(child_node) ? loop_depth + 1 : loop_depth;
+        // 调用的函数不确定时不算调用关系
+        if (strcmp(ts_node_type(child_node), "call_expression") == 0) {
+            std::string callee = get_resolvable_callee_short_name(child_node, source_code, scopes);
+            if (!callee.empty()) {
+                call_sites.push_back({callee, loop_depth});
+            }
+        }
+        // lambda和局部类里的调用不算在这个函数里
+        if (strcmp(ts_node_type(child_node), "lambda_expression") != 0) {
+            collect_call_sites(child_node, source_code, scopes, child_loop_depth, call_sites);
+        }
+    }
+}
+
+// 收集文件中所有函数定义的调用点，function_classes记录同名函数定义所在的类，自由函数为空
+void collect_function_call_sites(TSNode node, const std::string& source_code, std::unordered_map<std::string, std::vector<std::pair<std::string, uint32_t>>>& function_call_sites,
+    std::unordered_map<std::string, std::unordered_set<std::string>>& function_classes) {
+    uint32_t child_count = ts_node_named_child_count(node);
+    for (uint32_t i = 0; i < child_count; i++) {
+        TSNode child_node = ts_node_named_child(node, i);
+        if (strcmp(ts_node_type(child_node), "function_definition") == 0) {
+            std::string function_name = get_function_definition_name(child_node, source_code);
+            TSNode compound_statement_node = ts_node_child_by_node_type(child_node, "compound_statement");
+            if (!function_name.empty() && ts_node_is_null(compound_statement_node) == false) {
+                std::unordered_set<std::string> scopes = get_enclosing_scopes(child_node, function_name, source_code);
+                collect_call_sites(compound_statement_node, source_code, scopes, 0, function_call_sites[get_short_name(function_name)]);
+                function_classes[get_short_name(function_name)].insert(get_function_class_name(child_node, source_code, function_name));
+                continue;
+            }
+        }
+        collect_function_call_sites(child_node, source_code, function_call_sites, function_classes);
+    }
+}
+
+/**
+ * \brief 建立本文件内的调用关系: call_expression按名字的最后一段对应到本文件内的function_definition
+ * 只有不带限定、this->和限定名是所在类或命名空间的调用算调用关系，obj.f()、ptr->f()、Super::f()不算
+ * 单一调用者判断只考虑忽略列表，不考虑其他跳过规则；调用链A->B->C中B被跳过后C会保留
+ */
+void build_call_graph(TSNode root_node, const std::string& source_code, const std::unordered_set<std::string>& ignore_function_list, CallGraph& call_graph) {
+    std::unordered_map<std::string, std::vector<std::pair<std::string, uint32_t>>> function_call_sites;
+    std::unordered_map<std::string, std::unordered_set<std::string>> function_classes;
+    collect_function_call_sites(root_node, source_code, function_call_sites, function_classes);
+
+    for (const auto& function : function_call_sites) {
+        for (const auto& call_site : function.second) {
+            if (function_call_sites.count(call_site.first) == 0) {
+                continue;
+            }
+            call_graph.callers[call_site.first].insert(function.first);
+            call_graph.call_loop_depths[call_site.first].push_back(call_site.second);
+            if (call_site.second > 0) {
+                call_graph.loop_callees.insert(call_site.first);
+            }
+        }
+    }
+
+    std::unordered_set<std::string> ignored_short_names;
+    for (const auto& function_name : ignore_function_list) {
+        ignored_short_names.insert(get_short_name(function_name));
+    }
+
+    // 0未计算 1计算中 2插入 3被唯一调用者覆盖
+    std::unordered_map<std::string, int> states;
+    std::function<bool(const std::string&)> is_instrumented = [&](const std::string& name) -> bool {
+        int& state = states[name];
+        if (state == 1) {
+            return true;
+        }
+        if (state != 0) {
+            return state == 2;
+        }
+        state = 1;
+        bool instrumented = ignored_short_names.count(name) == 0;
+        auto callers_it = call_graph.callers.find(name);
+        if (instrumented && callers_it != call_graph.callers.end() && callers_it->second.size() == 1) {
+            const std::string& caller = *callers_it->second.begin();
+            if (caller != name && is_instrumented(caller)) {
+                call_graph.single_caller_callees.insert(name);
+                instrumented = false;
+            }
+        }
+        states[name] = instrumented ? 2 : 3;
+        return instrumented;
+    };
+    for (const auto& function : function_call_sites) {
+        is_instrumented(function.first);
+    }
+
+    // 从函数出发沿着调用关系能回到自己的是递归函数
+    // 同名函数的调用按名字对应，只有直接调用自己和同一个类里的调用链才能确定是递归，记录调用链方便检查
+    std::unordered_map<std::string, std::unordered_set<std::string>> callees;
+    for (const auto& callee : call_graph.callers) {
+        for (const auto& caller : callee.second) {
+            callees[caller].insert(callee.first);
+        }
+    }
+    auto get_single_class = [&function_classes](const std::string& name, std::string& class_name) {
+        auto classes_it = function_classes.find(name);
+        if (classes_it == function_classes.end() || classes_it->second.size() != 1) {
+            return false;
+        }
+        class_name = *classes_it->second.begin();
+        return true;
+    };
+    for (const auto& function : callees) {
+        const std::string& start = function.first;
+        if (function.second.count(start) > 0) {
+            call_graph.recursive_functions[start] = start + " -> " + start;
+            continue;
+        }
+        std::string start_class;
+        if (!get_single_class(start, start_class)) {
+            continue;
+        }
+        // 广度优先找最短的回到自己的调用链，只经过同一个类的函数
+        std::unordered_map<std::string, std::string> previous;
+        std::vector<std::string> pending(function.second.begin(), function.second.end());
+        for (const auto& name : pending) {
+            previous[name] = start;
+        }
+        for (size_t index = 0; index < pending.size(); index++) {
+            std::string name = pending[index];
+            std::string name_class;
+            if (!get_single_class(name, name_class) || name_class != start_class) {
+                continue;
+            }
+            auto callees_it = callees.find(name);
+            if (callees_it == callees.end()) {
+                continue;
+            }
+            if (callees_it->second.count(start) > 0) {
+                std::string cycle = start;
+                for (std::string step = name; step != start; step = previous[step]) {
+                    cycle.insert(start.size(), " -> " + step);
+                }
+                call_graph.recursive_functions[start] = cycle + " -> " + start;
+                break;
+            }
+            for (const auto& callee : callees_it->second) {
+                if (previous.count(callee) == 0 && callee != start) {
+                    previous[callee] = name;
+                    pending.push_back(callee);
+                }
+            }
+        }
+    }
+}
+
+// 预处理条件的值，known为false表示用到了不知道是否定义的宏
+struct PreprocessorValue {
+    bool known = false;
+    long long value = 0;
+};
+
+/**
+ * \brief 计算#if/#elif条件表达式的值，三态: 真、假、未知
+ */
+PreprocessorValue evaluate_preprocessor_condition(TSNode node, const std::string& source_code, const TraceOptions& options) {
+    PreprocessorValue result;
+    if (ts_node_is_null(node)) {
+        return result;
+    }
+    const char* type = ts_node_type(node);
+    std::string code = source_code.substr(ts_node_start_byte(node), ts_node_end_byte(node) - ts_node_start_byte(node));
+
+    if (strcmp(type, "number_literal") == 0) {
+        char* end = nullptr;
+        result.value = strtoll(code.c_str(), &end, 0);
+        result.known = end != code.c_str();
+    } else if (strcmp(type, "true") == 0 || strcmp(type, "false") == 0) {
+        result.known = true;
+        result.value = strcmp(type, "true") == 0 ? 1 : 0;
+    } else if (strcmp(type, "identifier") == 0) {
+        auto define_it = options.defines.find(code);
+        if (define_it != options.defines.end()) {
+            char* end = nullptr;
+            result.value = strtoll(define_it->second.c_str(), &end, 0);
+            result.known = end != define_it->second.c_str() && *end == '\0';
+        } else if (options.undefs.count(code) > 0) {
+            // 没有定义的宏在#if里是0
+            result.known = true;
+        }
+    } else if (strcmp(type, "preproc_defined") == 0) {
+        TSNode name_node = ts_find_node_in_first_child_level_by_type(node, "identifier");
+        std::string name = ts_node_is_null(name_node) ? "" : source_code.substr(ts_node_start_byte(name_node), ts_node_end_byte(name_node) - ts_node_start_byte(name_node));
+        result.known = options.defines.count(name) > 0 || options.undefs.count(name) > 0;
+        result.value = options.defines.count(name) > 0 ? 1 : 0;
+    } else if (strcmp(type, "parenthesized_expression") == 0) {
+        result = evaluate_preprocessor_condition(ts_node_named_child(node, 0), source_code, options);
+    } else if (strcmp(type, "unary_expression") == 0) {
+        TSNode operator_node = ts_node_child_by_field_name(node, "operator", strlen("operator"));
+        std::string op = ts_node_is_null(operator_node) ? "" : ts_node_type(operator_node);
+        PreprocessorValue argument = evaluate_preprocessor_condition(ts_node_child_by_field_name(node, "argument", strlen("argument")), source_code, options);
+        result.known = argument.known;
+        if (op == "!") {
+            result.value = !argument.value;
+        } else if (op == "-") {
+            // 按无符号取反，LLONG_MIN不会溢出
+            result.value = static_cast<long long>(0ULL - static_cast<unsigned long long>(argument.value));
+        } else if (op == "~") {
+            result.value = ~argument.value;
+        } else if (op == "+") {
+            result.value = argument.value;
+        } else {
+            result.known = false;
+        }
+    } else if (strcmp(type, "binary_expression") == 0) {
+        TSNode operator_node = ts_node_child_by_field_name(node, "operator", strlen("operator"));
+        std::string op = ts_node_is_null(operator_node) ? "" : ts_node_type(operator_node);
+        PreprocessorValue left = evaluate_preprocessor_condition(ts_node_child_by_field_name(node, "left", strlen("left")), source_code, options);
+        PreprocessorValue right = evaluate_preprocessor_condition(ts_node_child_by_field_name(node, "right", strlen("right")), source_code, options);
+        // 一边已知就能确定结果的情况
+        if (op == "&&" && ((left.known && left.value == 0) || (right.known && right.value == 0))) {
+            result.known = true;
+            return result;
+        }
+        if (op == "||" && ((left.known && left.value != 0) || (right.known && right.value != 0))) {
+            result.known = true;
+            result.value = 1;
+            return result;
+        }
+        result.known = left.known && right.known;
+        long long a = left.value;
+        long long b = right.value;
+        if (op == "&&") result.value = a && b;
+        else if (op == "||") result.value = a || b;
+        else if (op == "==") result.value = a == b;
+        else if (op == "!=") result.value = a != b;
+        else if (op == "<") result.value = a < b;
+        else if (op == "<=") result.value = a <= b;
+        else if (op == ">") result.value = a > b;
+        else if (op == ">=") result.value = a >= b;
+        // 加减乘按无符号回绕，避免有符号溢出；除以0、LLONG_MIN / -1和超出位宽的移位是未定义行为，当作未知
+        else if (op == "+") result.value = static_cast<long long>(static_cast<unsigned long long>(a) + static_cast<unsigned long long>(b));
+        else if (op == "-") result.value = static_cast<long long>(static_cast<unsigned long long>(a) - static_cast<unsigned long long>(b));
+        else if (op == "*") result.value = static_cast<long long>(static_cast<unsigned long long>(a) * static_cast<unsigned long long>(b));
+        else if ((op == "/" || op == "%") && (b == 0 || (a == LLONG_MIN && b == -1))) result.known = false;
+        else if (op == "/") result.value = a / b;
+        else if (op == "%") result.value = a % b;
+        else if (op == "&") result.value = a & b;
+        else if (op == "|") result.value = a | b;
+        else if (op == "^") result.value = a ^ b;
+        else if ((op == "<<" || op == ">>") && (b < 0 || b >= 64)) result.known = false;
+        else if (op == "<<") result.value = static_cast<long long>(static_cast<unsigned long long>(a) << b);
+        else if (op == ">>") result.value = a >> b;
+        else result.known = false;
+    } else if (strcmp(type, "conditional_expression") == 0) {
+        PreprocessorValue condition = evaluate_preprocessor_condition(ts_node_child_by_field_name(node, "condition", strlen("condition")), source_code, options);
+        if (condition.known) {
+            const char* branch = condition.value != 0 ? "consequence" : "alternative";
+            result = evaluate_preprocessor_condition(ts_node_child_by_field_name(node, branch, static_cast<uint32_t>(strlen(branch))), source_code, options);
+        }
+    }
+    // 其他的(函数形式的宏等)都是未知
+    return result;
+}
+
+/**
+ * \brief 去掉node(包括node本身)里忽略列表中的函数之前插入的Trace，用于不会编译、不再插入的代码
+ */
+void strip_ignored_functions(TSNode node, const std::string& source_code, std::vector<TextEdit>& edits, const std::unordered_set<std::string>& ignore_function_list, TraceStats& stats) {
+    if (strcmp(ts_node_type(node), "function_definition") == 0) {
+        std::string function_name = get_function_definition_name(node, source_code);
+        TSNode compound_statement_node = ts_node_child_by_node_type(node, "compound_statement");
+        if (!function_name.empty() && ignore_function_list.count(function_name) > 0 && ts_node_is_null(compound_statement_node) == false) {
+            size_t trace_start = find_leading_trace_statement(compound_statement_node, source_code);
+            if (trace_start != std::string::npos && strip_trace_statement(source_code, trace_start, edits)) {
+                stats.stripped++;
+            }
+        }
+        return;
+    }
+    uint32_t child_count = ts_node_named_child_count(node);
+    for (uint32_t i = 0; i < child_count; i++) {
+        strip_ignored_functions(ts_node_named_child(node, i), source_code, edits, ignore_function_list, stats);
+    }
+}
+
+// 是否是#if/#ifdef/#ifndef/#elif/#elifdef条件分支
+bool ts_is_preproc_conditional(TSNode node) {
+    const char* type = ts_node_type(node);
+    return strcmp(type, "preproc_if") == 0 || strcmp(type, "preproc_ifdef") == 0 || strcmp(type, "preproc_elif") == 0 || strcmp(type, "preproc_elifdef") == 0;
+}
+
+void collect_inactive_ranges(TSNode node, const std::string& source_code, const TraceOptions& options, std::vector<std::pair<uint32_t, uint32_t>>& ranges);
+
+/**
+ * \brief 处理一个条件分支: 条件为假时分支内容不会编译，为真时后面的#elif/#else都不会编译
+ * 条件未知时两边都当作会编译，继续查找里面嵌套的条件
+ */
+void collect_conditional_inactive_ranges(TSNode node, const std::string& source_code, const TraceOptions& options, std::vector<std::pair<uint32_t, uint32_t>>& ranges) {
+    PreprocessorValue condition;
+    TSNode condition_node = ts_node_child_by_field_name(node, "condition", strlen("condition"));
+    if (ts_node_is_null(condition_node)) {
+        // #ifdef/#ifndef/#elifdef/#elifndef 宏名
+        condition_node = ts_node_child_by_field_name(node, "name", strlen("name"));
+        std::string name = ts_node_is_null(condition_node) ? "" : source_code.substr(ts_node_start_byte(condition_node), ts_node_end_byte(condition_node) - ts_node_start_byte(condition_node));
+        std::string directive = ts_node_type(ts_node_child(node, 0));
+        bool negate = directive == "#ifndef" || directive == "#elifndef";
+        condition.known = options.defines.count(name) > 0 || options.undefs.count(name) > 0;
+        condition.value = (options.defines.count(name) > 0) != negate;
+    } else {
+        condition = evaluate_preprocessor_condition(condition_node, source_code, options);
+    }
+    if (ts_node_is_null(condition_node)) {
+        collect_inactive_ranges(node, source_code, options, ranges);
+        return;
+    }
+
+    TSNode alternative_node = ts_node_child_by_field_name(node, "alternative", strlen("alternative"));
+    uint32_t body_start = ts_node_end_byte(condition_node);
+    uint32_t body_end = ts_node_is_null(alternative_node) ? ts_node_end_byte(node) : ts_node_start_byte(alternative_node);
+    if (condition.known && condition.value == 0) {
+        ranges.push_back({body_start, body_end});
+    } else {
+        for (uint32_t i = 0; i < ts_node_named_child_count(node); i++) {
+            TSNode body_node = ts_node_named_child(node, i);
+            if (ts_node_start_byte(body_node) < body_start || ts_node_end_byte(body_node) > body_end) {
+                continue;
+            }
+            if (ts_is_preproc_conditional(body_node)) {
+                collect_conditional_inactive_ranges(body_node, source_code, options, ranges);
+            } else {
+                collect_inactive_ranges(body_node, source_code, options, ranges);
+            }
+        }
+    }
+
+    if (ts_node_is_null(alternative_node)) {
+        return;
+    }
+    if (condition.known && condition.value != 0) {
+        ranges.push_back({ts_node_start_byte(alternative_node), ts_node_end_byte(alternative_node)});
+    } else if (ts_is_preproc_conditional(alternative_node)) {
+        collect_conditional_inactive_ranges(alternative_node, source_code, options, ranges);
+    } else {
+        collect_inactive_ranges(alternative_node, source_code, options, ranges);
+    }
+}
+
+/**
+ * \brief 收集按已知的宏定义不会编译的#if/#ifdef/#elif/#else分支的字节范围
+ */
+void collect_inactive_ranges(TSNode node, const std::string& source_code, const TraceOptions& options, std::vector<std::pair<uint32_t, uint32_t>>& ranges) {
+    uint32_t child_count = ts_node_named_child_count(node);
+    for (uint32_t i = 0; i < child_count; i++) {
+        TSNode child_node = ts_node_named_child(node, i);
+        if (ts_is_preproc_conditional(child_node)) {
+            collect_conditional_inactive_ranges(child_node, source_code, options, ranges);
+        } else {
+            collect_inactive_ranges(child_node, source_code, options, ranges);
+        }
+    }
+}
+
+// 节点是否完全在不会编译的范围里
+bool ts_is_inactive(TSNode node, const TraceOptions& options) {
+    if (options.inactive_ranges == nullptr) {
+        return false;
+    }
+    for (const auto& range : *options.inactive_ranges) {
+        if (ts_node_start_byte(node) >= range.first && ts_node_end_byte(node) <= range.second) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * \brief 把代码块开头插入的按名字的Trace(trace_macro_name)改成macro_name，例如--kill-switch时改成开关宏
+ * \return 是否修改
+ */
+bool rename_leading_trace_statement(TSNode body_node, const std::string& source_code, const std::string& macro_name, std::vector<TextEdit>& edits) {
+    if (macro_name == trace_macro_name) {
+        return false;
+    }
+    size_t trace_start = find_leading_trace_statement(body_node, source_code);
+    if (trace_start == std::string::npos || source_code.compare(trace_start, trace_macro_name.size() + 1, trace_macro_name + "(") != 0) {
+        return false;
+    }
+    edits.push_back({trace_start, trace_macro_name.size(), macro_name});
+    return true;
+}
+
+/**
+ * \brief 在循环体、lambda等代码块开头插入名字为name的Trace
+ * 和函数一样检查忽略列表和重复插入，忽略列表中的代码块之前插入过的Trace会去掉
+ * \return 是否插入
+ */
+bool insert_block_scope(TSNode body_node, const std::string& source_code, const std::string& name, uint32_t line, std::vector<TextEdit>& insertions, std::ofstream& log_file, const std::unordered_set<std::string>& ignore_function_list, const TraceOptions& options, TraceStats& stats) {
+    // 只处理有{}并且不为空的代码块
+    if (ts_node_is_null(body_node) || strcmp(ts_node_type(body_node), "compound_statement") != 0 || ts_node_named_child_count(body_node) == 0) {
+        return false;
+    }
+    TSNode first_child_node = ts_node_child(body_node, 1);
+    std::string first_child_node_code = source_code.substr(ts_node_start_byte(first_child_node), ts_node_end_byte(first_child_node) - ts_node_start_byte(first_child_node));
+
+    if (ignore_function_list.count(name) > 0) {
+        size_t trace_start = find_leading_trace_statement(body_node, source_code);
+        if (trace_start != std::string::npos && strip_trace_statement(source_code, trace_start, insertions)) {
+            stats.stripped++;
+        }
+        return false;
+    }
+    if ((options.registry == nullptr || !options.id_all) && rename_leading_trace_statement(body_node, source_code, options.name_macro_name, insertions)) {
+        stats.renamed++;
+        return false;
+    }
+    if (first_child_node_code.find("TRACE_CPUPROFILER_EVENT_SCOPE") != std::string::npos || first_child_node_code.find("SCOPE_CYCLE_COUNTER") != std::string::npos
+        || find_leading_trace_statement(body_node, source_code) != std::string::npos) {
+        return false;
+    }
+
+    bool uses_id = options.registry != nullptr && options.id_all;
+    std::string trace_line = uses_id ? options.id_macro_name + "({Id});" : options.name_macro_name + "(" + name + ");";
+    if (options.insert_marker) {
+        trace_line += trace_marker;
+    }
+    TextEdit insertion = make_trace_insertion(source_code, ts_node_start_byte(body_node) + 1, first_child_node, trace_line, options);
+    if (!trace_insertion_round_trips(source_code, insertion)) {
+        stats.skipped["strip-round-trip"]++;
+        return false;
+    }
+    // 确定插入后再分配ID
+    if (uses_id) {
+        replace_all(insertion.text, "{Id}", std::to_string(options.registry->get_or_add(name, options.relative_path, line)));
+        stats.id_scopes++;
+    }
+    PRINT_MSG_GREEN("block: " << name)
+
+#if InsertTraceToFunction
+    insertions.push_back(insertion);
+#endif
+    return true;
+}
+
+/**
+ * \brief 协程里只给不包含挂起点的代码块插入Trace，名字是 函数名_Segment序号
+ * Trace在代码块结束时关闭，不会跨过挂起点；包含挂起点的代码块和switch的代码块继续往里找
+ * 序号是不包含挂起点的代码块在函数里按出现顺序的编号(从1开始，包括太小没有插入的)，函数前面增删代码时不变
+ */
+void insert_coroutine_segment_scopes(TSNode node, const std::string& source_code, const std::string& function_name, uint32_t& segment_ordinal, std::vector<TextEdit>& insertions, std::ofstream& log_file, const std::unordered_set<std::string>& ignore_function_list, const TraceOptions& options, TraceStats& stats) {
+    uint32_t child_count = ts_node_named_child_count(node);
+    for (uint32_t i = 0; i < child_count; i++) {
+        TSNode child_node = ts_node_named_child(node, i);
+        if (strcmp(ts_node_type(child_node), "lambda_expression") == 0 || strcmp(ts_node_type(child_node), "function_definition") == 0) {
+            continue;
+        }
+        // switch的代码块开头插入的Trace会被case跳过(C2360)，只往case里面的代码块找
+        bool is_switch_body = strcmp(ts_node_type(node), "switch_statement") == 0
+            || (ts_node_named_child_count(child_node) > 0 && strcmp(ts_node_type(ts_node_named_child(child_node, 0)), "case_statement") == 0);
+        if (strcmp(ts_node_type(child_node), "compound_statement") != 0 || is_switch_body || ts_has_coroutine_keyword(child_node)) {
+            insert_coroutine_segment_scopes(child_node, source_code, function_name, segment_ordinal, insertions, log_file, ignore_function_list, options, stats);
+            continue;
+        }
+        uint32_t ordinal = ++segment_ordinal;
+        if (ts_node_end_byte(child_node) - ts_node_start_byte(child_node) < options.loop_min_bytes) {
+            continue;
+        }
+        uint32_t line = ts_node_start_point(child_node).row + 1;
+        if (insert_block_scope(child_node, source_code, function_name + "_Segment" + std::to_string(ordinal), line, insertions, log_file, ignore_function_list, options, stats)) {
+            stats.coroutine_segment_scopes++;
+        }
     }
+}
 
-    // 遍历所有子节点
+/**
+ * \brief 给函数体内字节数超过阈值的循环在循环体开头插入Trace，名字是 函数名_Loop序号
+ * 序号是循环在函数里按出现顺序的编号(从1开始，包括没有插入的循环)，函数前面增删代码时不变
+ */
+void insert_loop_scopes(TSNode node, const std::string& source_code, const std::string& function_name, uint32_t min_bytes, uint32_t& loop_ordinal, std::vector<TextEdit>& insertions, std::ofstream& log_file, const std::unordered_set<std::string>& ignore_function_list, const TraceOptions& options, TraceStats& stats) {
     uint32_t child_count = ts_node_named_child_count(node);
     for (uint32_t i = 0; i < child_count; i++) {
         TSNode child_node = ts_node_named_child(node, i);
-        TSNode result = ts_find_node_by_type(child_node, node_type);
+        // lambda和局部类的成员函数有自己的函数体，不算在这个函数里
+        if (strcmp(ts_node_type(child_node), "lambda_expression") == 0 || strcmp(ts_node_type(child_node), "function_definition") == 0) {
+            continue;
+        }
+        // 不会编译的循环也要编号，序号不随--define/--undef变化；里面的循环也会因为不会编译而跳过
+        uint32_t ordinal = ts_is_loop_node(child_node) ? ++loop_ordinal : 0;
+        insert_loop_scopes(child_node, source_code, function_name, min_bytes, loop_ordinal, insertions, log_file, ignore_function_list, options, stats);
+        if (ts_is_inactive(child_node, options)) {
+            continue;
+        }
+        if (!ts_is_loop_node(child_node) || ts_node_end_byte(child_node) - ts_node_start_byte(child_node) < min_bytes) {
+            continue;
+        }
 
-        // 如果找到了指定类型的节点，返回它
-        if (ts_node_is_null(result) == 0) {
-            return result;
+        TSNode body_node = ts_node_child_by_field_name(child_node, "body", strlen("body"));
+        uint32_t line = ts_node_start_point(child_node).row + 1;
+        // 循环体里有挂起点时Trace会跨过挂起点
+        if (ts_node_is_null(body_node) == false && ts_has_coroutine_keyword(body_node)) {
+            continue;
+        }
+        if (insert_block_scope(body_node, source_code, function_name + "_Loop" + std::to_string(ordinal), line, insertions, log_file, ignore_function_list, options, stats)) {
+            stats.loop_scopes++;
         }
     }
-
-    // 如果没有找到指定类型的节点，返回一个空节点
-    return TSNode();
 }
 
-TSNode ts_find_node_in_first_child_level_by_type(TSNode node, const char* node_type) {
-    // 遍历所有子节点
+/**
+ * \brief 给作为参数传给指定函数(ParallelFor、AsyncTask、CreateLambda等)的lambda插入Trace，名字是 函数名_Lambda序号
+ * 序号是lambda在函数里按出现顺序的编号(从1开始，包括没有插入的lambda)，函数前面增删代码时不变
+ */
+void insert_lambda_scopes(TSNode node, const std::string& source_code, const std::string& function_name, uint32_t& lambda_ordinal, std::vector<TextEdit>& insertions, std::ofstream& log_file, const std::unordered_set<std::string>& ignore_function_list, const TraceOptions& options, TraceStats& stats) {
     uint32_t child_count = ts_node_named_child_count(node);
     for (uint32_t i = 0; i < child_count; i++) {
         TSNode child_node = ts_node_named_child(node, i);
-        if (ts_node_is_null(child_node) == 1) {
+        // 局部类的成员函数不算在这个函数里
+        if (strcmp(ts_node_type(child_node), "function_definition") == 0) {
+            continue;
+        }
+        // 不会编译的lambda也要编号，序号不随--define/--undef变化；里面的lambda也会因为不会编译而跳过
+        uint32_t ordinal = strcmp(ts_node_type(child_node), "lambda_expression") == 0 ? ++lambda_ordinal : 0;
+        // 嵌套的lambda也处理，例如任务里再ParallelFor
+        insert_lambda_scopes(child_node, source_code, function_name, lambda_ordinal, insertions, log_file, ignore_function_list, options, stats);
+        if (ts_is_inactive(child_node, options)) {
+            continue;
+        }
+        if (strcmp(ts_node_type(child_node), "lambda_expression") != 0 || strcmp(ts_node_type(node), "argument_list") != 0) {
+            continue;
+        }
+        TSNode call_node = ts_node_parent(node);
+        if (ts_node_is_null(call_node) || strcmp(ts_node_type(call_node), "call_expression") != 0 || options.lambda_calls.count(get_callee_short_name(call_node, source_code)) == 0) {
             continue;
         }
 
-        // 获取当前节点的类型
-	    const char* child_node_type = ts_node_type(child_node);
-
-	    // 检查当前节点的类型是否是指定的类型
-	    if (strcmp(child_node_type, node_type) == 0) {
-	        return child_node;
-	    }
-    }
-
-    // 如果没有找到指定类型的节点，返回一个空节点
-    return TSNode();
-}
-
-bool ts_check_node_source_code(const std::string& source_code,TSNode node, const char* in_node_code) {
-    if(ts_node_is_null(node)==false)
-    {
-        std::string node_code = source_code.substr(ts_node_start_byte(node), ts_node_end_byte(node) - ts_node_start_byte(node));
-        if (in_node_code==node_code) {
-	        return true;
-	    }
-    }
-    return false;
-}
-
-TSNode ts_find_error_node(TSNode node) {
-    const char* node_type = ts_node_type(node);
-    if (strcmp(node_type, "ERROR") == 0) {
-        return node;
-    }
-
-    uint32_t child_count = ts_node_child_count(node);
-    for (uint32_t i = 0; i < child_count; i++) {
-        TSNode child = ts_node_child(node, i);
-        TSNode error_node = ts_find_error_node(child);
-        if (ts_node_is_null(error_node)==false && strcmp(ts_node_type(error_node), "ERROR") == 0) {
-            return error_node;
+        TSNode body_node = ts_node_child_by_field_name(child_node, "body", strlen("body"));
+        uint32_t line = ts_node_start_point(child_node).row + 1;
+        if (ts_node_is_null(body_node) == false && ts_has_coroutine_keyword(body_node)) {
+            // 协程lambda的Trace会跨过挂起点
+            stats.coroutines.push_back(options.relative_path + ":" + std::to_string(line) + " " + function_name + "_Lambda" + std::to_string(ordinal));
+            continue;
+        }
+        if (insert_block_scope(body_node, source_code, function_name + "_Lambda" + std::to_string(ordinal), line, insertions, log_file, ignore_function_list, options, stats)) {
+            stats.lambda_scopes++;
         }
     }
-
-    // Return an empty node if no error node was found
-    return TSNode();
 }
 
-
 /**
  * \brief 遍历并打印节点及其所有子节点
  * \param node 要遍历的节点
  * \param source_code 源代码字符串
  * \param insertions 保存需要插入的字符串和位置的向量
  */
-void traverse_and_print(TSNode node, const std::string& source_code, std::vector<std::pair<size_t, std::string>>& insertions,std::ofstream& log_file,std::unordered_set<std::string>& ignore_function_list) {
+void traverse_and_print(TSNode node, const std::string& source_code, std::vector<TextEdit>& insertions,std::ofstream& log_file,std::unordered_set<std::string>& ignore_function_list,const TraceOptions& options,TraceStats& stats) {
     while (ts_node_is_null(node) == false) {
         // 打印节点的类型
         const char* node_type = ts_node_type(node);
@@ -222,6 +3077,15 @@ void traverse_and_print(TSNode node, const std::string& source_code, std::vector
     	std::string node_code = source_code.substr(ts_node_start_byte(node), ts_node_end_byte(node) - ts_node_start_byte(node));
         //PRINT_MSG("Node code: "<<node_code)
 
+        // 按已知的宏定义不会编译的代码不处理，只去掉忽略列表中的函数之前插入的Trace
+        if (ts_is_inactive(node, options)) {
+            strip_ignored_functions(node, source_code, insertions, ignore_function_list, stats);
+            if (strcmp(node_type, "function_definition") == 0) {
+                NODE_SKIP_CONTINUE("inactive-#if")
+            }
+            NODE_CONTINUE()
+        }
+
         // function_definition节点下第一层子节点存在function_declarator
         // 在function_declarator第一层子节点查找函数定义(静态函数identifier/field_identifier/qualified_identifier)和参数(parameter_list)
 
@@ -242,7 +3106,6 @@ void traverse_and_print(TSNode node, const std::string& source_code, std::vector
             {
                 NODE_ERROR_CONTINUE_TRAVERSE("function_declarator",node_code)
             }
-            std::string function_declarator_node_code = source_code.substr(ts_node_start_byte(function_declarator_node), ts_node_end_byte(function_declarator_node) - ts_node_start_byte(function_declarator_node));
 
             // 在function_declarator第一层子节点查找函数定义(静态函数identifier/field_identifier/qualified_identifier)和参数(parameter_list)
             TSNode function_declarator_identifier_node = ts_find_node_in_first_child_level_by_type(function_declarator_node, "identifier");
@@ -281,9 +3144,6 @@ void traverse_and_print(TSNode node, const std::string& source_code, std::vector
 	            }
                 std::string first_child_node_code = source_code.substr(ts_node_start_byte(first_child_node), ts_node_end_byte(first_child_node) - ts_node_start_byte(first_child_node));
 
-                // 获取开始位置
-				uint32_t first_child_start = ts_node_start_byte(first_child_node);
-
                 // 获取函数名
 	            TSNode function_name_node = ts_node_child_by_field_name(function_declarator_node, "declarator", strlen("declarator"));
 	            if(ts_node_is_null(function_name_node))
@@ -300,11 +3160,120 @@ void traverse_and_print(TSNode node, const std::string& source_code, std::vector
 
                 // 检查函数是否在忽略列表中
 		        if (ignore_function_list.count(function_name) > 0) {
-		            // 忽略这个函数
+		            // 忽略这个函数，之前插入过Trace的去掉
+		            size_t trace_start = find_leading_trace_statement(compound_statement_node, source_code);
+		            if (trace_start != std::string::npos && strip_trace_statement(source_code, trace_start, insertions)) {
+		                stats.stripped++;
+		            }
 		            NODE_CONTINUE()
 		        }
 
-                std::string trace_line = "TRACE_CPUPROFILER_EVENT_SCOPE_WHEN_TRACING(" + function_name + ");";
+                // 规则指定的函数给循环体插入Trace，和函数本身是否插入无关
+                if (options.loop_functions != nullptr && !options.collect_candidates) {
+                    auto loop_it = options.loop_functions->find(function_name);
+                    if (loop_it != options.loop_functions->end()) {
+                        uint32_t loop_min_bytes = loop_it->second > 0 ? loop_it->second : options.loop_min_bytes;
+                        uint32_t loop_ordinal = 0;
+                        insert_loop_scopes(compound_statement_node, source_code, function_name, loop_min_bytes, loop_ordinal, insertions, log_file, ignore_function_list, options, stats);
+                    }
+                }
+
+                // 传给ParallelFor、AsyncTask等的lambda插入Trace
+                if (!options.lambda_calls.empty() && !options.collect_candidates) {
+                    uint32_t lambda_ordinal = 0;
+                    insert_lambda_scopes(compound_statement_node, source_code, function_name, lambda_ordinal, insertions, log_file, ignore_function_list, options, stats);
+                }
+
+                // 协程在开头插入的Trace会跨过挂起点，不插入，可以只给同步执行的代码块插入
+                if (ts_has_coroutine_keyword(compound_statement_node)) {
+                    if (!options.collect_candidates) {
+                        stats.coroutines.push_back(options.relative_path + ":" + std::to_string(ts_node_start_point(node).row + 1) + " " + function_name);
+                        if (options.coroutine_segments) {
+                            uint32_t segment_ordinal = 0;
+                            insert_coroutine_segment_scopes(compound_statement_node, source_code, function_name, segment_ordinal, insertions, log_file, ignore_function_list, options, stats);
+                        }
+                    }
+                    NODE_SKIP_CONTINUE("coroutine")
+                }
+
+                // 按宏规则选择插入的宏，按ID插入时先保留{Id}，通过所有跳过规则、确定插入后再分配ID
+                std::string trace_line = options.name_macro_name + "(" + function_name + ");";
+                bool uses_id = false;
+                const MacroRule* macro_rule = nullptr;
+                std::string class_name;
+                if (options.macro_rules != nullptr) {
+                    class_name = get_function_class_name(node, source_code, function_name);
+                    macro_rule = find_macro_rule(*options.macro_rules, options.relative_path, class_name, get_short_name(function_name));
+                    if (macro_rule != nullptr && macro_rule->macro_template.empty()) {
+                        NODE_SKIP_CONTINUE("macro-rule")
+                    }
+                }
+                if (macro_rule != nullptr) {
+                    uint32_t line = ts_node_start_point(node).row + 1;
+                    trace_line = macro_rule->macro_template + ";";
+                    replace_all(trace_line, "{Name}", function_name);
+                    replace_all(trace_line, "{Short}", get_short_name(function_name));
+                    replace_all(trace_line, "{Class}", class_name);
+                    replace_all(trace_line, "{File}", std::filesystem::path(options.relative_path).stem().string());
+                    replace_all(trace_line, "{Line}", std::to_string(line));
+                    uses_id = options.registry != nullptr && !options.collect_candidates && trace_line.find("{Id}") != std::string::npos;
+                } else if (options.registry != nullptr && !options.collect_candidates) {
+                    // 只有采样的函数和只记录最外层调用的递归函数需要ID，其他函数除非id_all都插入函数名
+                    uint32_t sample_every = 0;
+                    if (options.sample_functions != nullptr) {
+                        auto sample_it = options.sample_functions->find(function_name);
+                        sample_every = sample_it != options.sample_functions->end() ? sample_it->second : 0;
+                    }
+                    const std::string* recursion = nullptr;
+                    if (options.outermost_recursive && options.call_graph != nullptr) {
+                        auto recursive_it = options.call_graph->recursive_functions.find(get_short_name(function_name));
+                        recursion = recursive_it != options.call_graph->recursive_functions.end() ? &recursive_it->second : nullptr;
+                    }
+                    bool outermost = recursion != nullptr;
+                    if (options.id_all || sample_every > 0 || outermost) {
+                        uses_id = true;
+                        trace_line = options.id_macro_name + "({Id});";
+                        if (sample_every > 0) {
+                            trace_line = trace_sampled_macro_name + "({Id}, " + std::to_string(sample_every) + ");";
+                        }
+                        if (outermost) {
+                            trace_line = trace_outermost_macro_name + "({Id});";
+                            PRINT_MSG_GREEN("outermost: " << function_name << ", recursion: " << *recursion)
+                        }
+                    }
+                }
+                // 宏规则插入的宏可能也有手写的，总是加标记，去除时只去除带标记的
+                if (options.insert_marker || macro_rule != nullptr) {
+                    trace_line += trace_marker;
+                }
+
+                // 已经有宏规则中的宏的函数不再插入
+                auto has_rule_macro = [&options](const std::string& statement_code) {
+                    for (const auto& macro_name : options.rule_macro_names) {
+                        size_t paren = statement_code.find_first_not_of(" \t", macro_name.size());
+                        if (statement_code.compare(0, macro_name.size(), macro_name) == 0 && paren != std::string::npos && statement_code[paren] == '(') {
+                            return true;
+                        }
+                    }
+                    return false;
+                };
+                if (has_rule_macro(first_child_node_code)) {
+                    stats.existing_scopes++;
+                    NODE_CONTINUE()
+                }
+
+                // 之前插入的按名字的Trace改成现在的名字宏
+                if (!uses_id && macro_rule == nullptr && rename_leading_trace_statement(compound_statement_node, source_code, options.name_macro_name, insertions)) {
+                    stats.renamed++;
+                    stats.existing_scopes++;
+                    NODE_CONTINUE()
+                }
+
+                // 判断提前返回检查之后是否已经插入过，插入过的函数占用预算
+                if (find_leading_trace_statement(compound_statement_node, source_code) != std::string::npos) {
+                    stats.existing_scopes++;
+                    NODE_CONTINUE()
+                }
 
                 // 判断是否已经插入过TRACE_CPUPROFILER_EVENT_SCOPE_WHEN_TRACING
                 if (first_child_node_code.find("TRACE_CPUPROFILER_EVENT_SCOPE_WHEN_TRACING") != std::string::npos) {
@@ -316,14 +3285,141 @@ void traverse_and_print(TSNode node, const std::string& source_code, std::vector
                     NODE_CONTINUE()
                 }
 
-                PRINT_MSG_GREEN("function_name: "<<function_name)
+                // 已经有Stat计时的函数不再插入，避免重复计时
+                if (first_child_node_code.find("SCOPE_CYCLE_COUNTER") != std::string::npos) {
+                    NODE_CONTINUE()
+                }
+
+                // 函数体里已有的计时宏会迁移成_WHEN_TRACING版本，再插入会重复计时
+                if (options.migrate && ts_has_migrate_scope(compound_statement_node, source_code)) {
+                    NODE_SKIP_CONTINUE("migrate-scope")
+                }
+
 
-#if InsertTraceToFunction
-                // 获取函数体与第一个Node之间的空白字符
-                std::string blank_chars = source_code.substr(ts_node_start_byte(compound_statement_node)+1, ts_node_start_byte(first_child_node) - ts_node_start_byte(compound_statement_node)-1);
+                // 插入到开头的提前返回检查之后，提前返回时不产生Trace事件
+                TSNode insert_before_node = first_child_node;
+                uint32_t blank_start = ts_node_start_byte(compound_statement_node) + 1;
+                if (options.insert_after_guards) {
+                    TSNode last_guard_node = TSNode();
+                    for (TSNode child_node = first_child_node; ts_node_is_null(child_node) == false && ts_node_is_named(child_node); child_node = ts_node_next_sibling(child_node)) {
+                        if (ts_is_guard_statement(child_node, source_code)) {
+                            last_guard_node = child_node;
+                        } else if (strcmp(ts_node_type(child_node), "comment") != 0) {
+                            break;
+                        }
+                    }
+                    if (ts_node_is_null(last_guard_node) == false) {
+                        insert_before_node = ts_node_next_sibling(last_guard_node);
+                        blank_start = ts_node_end_byte(last_guard_node);
+                        // 只有检查没有其他语句的函数不需要插入
+                        if (ts_node_is_null(insert_before_node) || ts_node_is_named(insert_before_node) == false) {
+                            NODE_SKIP_CONTINUE("guard-only")
+                        }
+
+                        // 检查之后已经有计时宏的函数不再插入，否则重复计时，--same-line时按__LINE__命名的变量还会重复定义
+                        std::string insert_before_code = source_code.substr(ts_node_start_byte(insert_before_node), ts_node_end_byte(insert_before_node) - ts_node_start_byte(insert_before_node));
+                        if (has_rule_macro(insert_before_code)) {
+                            stats.existing_scopes++;
+                            NODE_CONTINUE()
+                        }
+                        if (insert_before_code.find("TRACE_CPUPROFILER_EVENT_SCOPE") != std::string::npos || insert_before_code.find("SCOPE_CYCLE_COUNTER") != std::string::npos) {
+                            NODE_CONTINUE()
+                        }
+                        // 没有--migrate时也要检查，检查之后函数体里的计时宏和插入的Trace会重复计时
+                        if (!options.migrate && ts_has_migrate_scope(compound_statement_node, source_code)) {
+                            NODE_SKIP_CONTINUE("guarded-scope")
+                        }
+                    }
+                }
+
+                // 按函数属性和宏跳过
+                std::string specifiers_code = source_code.substr(ts_node_start_byte(node), ts_node_start_byte(function_declarator_node) - ts_node_start_byte(node));
+                std::unordered_set<std::string> specifier_tokens = get_identifier_tokens(specifiers_code);
+                if (options.attribute_rules.count("forceinline") > 0 && (specifier_tokens.count("FORCEINLINE") > 0 || specifier_tokens.count("FORCEINLINE_DEBUGGABLE") > 0)) {
+                    NODE_SKIP_CONTINUE("forceinline")
+                }
+                if (options.attribute_rules.count("forcenoinline") > 0 && specifier_tokens.count("FORCENOINLINE") > 0) {
+                    NODE_SKIP_CONTINUE("forcenoinline")
+                }
+                if (options.attribute_rules.count("inline") > 0 && specifier_tokens.count("inline") > 0) {
+                    NODE_SKIP_CONTINUE("inline")
+                }
+                if (options.attribute_rules.count("consteval") > 0 && specifier_tokens.count("consteval") > 0) {
+                    NODE_SKIP_CONTINUE("consteval")
+                }
+                if (options.attribute_rules.count("noexcept") > 0 && ts_is_noexcept_true(function_declarator_node, source_code)) {
+                    NODE_SKIP_CONTINUE("noexcept")
+                }
+                if (options.attribute_rules.count("nodiscard-accessor") > 0 && (specifier_tokens.count("UE_NODISCARD") > 0 || specifier_tokens.count("nodiscard") > 0)
+                    && ts_is_pure_return_body(compound_statement_node)) {
+                    NODE_SKIP_CONTINUE("nodiscard-accessor")
+                }
+                if (options.attribute_rules.count("anon-loop-callee") > 0 && options.call_graph != nullptr
+                    && options.call_graph->loop_callees.count(get_short_name(function_name)) > 0 && ts_is_in_anonymous_namespace(node)) {
+                    NODE_SKIP_CONTINUE("anon-loop-callee")
+                }
+
+                // 按本文件的调用关系跳过，调用者的Trace已经包含了它的耗时
+                if (options.call_graph != nullptr) {
+                    std::string short_name = get_short_name(function_name);
+                    if (options.attribute_rules.count("loop-callee") > 0 && options.call_graph->loop_callees.count(short_name) > 0) {
+                        stats.estimated_events_saved += options.call_graph->estimate_events(short_name, options.loop_trip);
+                        NODE_SKIP_CONTINUE("loop-callee")
+                    }
+                    if (options.attribute_rules.count("single-caller") > 0 && options.call_graph->single_caller_callees.count(short_name) > 0) {
+                        stats.estimated_events_saved += options.call_graph->estimate_events(short_name, options.loop_trip);
+                        NODE_SKIP_CONTINUE("single-caller")
+                    }
+                    if (options.attribute_rules.count("recursive") > 0 && options.call_graph->recursive_functions.count(short_name) > 0) {
+                        NODE_SKIP_CONTINUE("recursive")
+                    }
+                }
+
+                // 静态开销过滤
+                if (options.skip_pure_return && ts_is_pure_return_body(compound_statement_node)) {
+                    NODE_SKIP_CONTINUE("pure-return")
+                }
+                if (options.min_body_bytes > 0 && compound_statement_node_code.size() < options.min_body_bytes) {
+                    NODE_SKIP_CONTINUE("min-body-bytes")
+                }
+                if (options.min_statements > 0 && ts_count_statements(compound_statement_node) < options.min_statements) {
+                    NODE_SKIP_CONTINUE("min-statements")
+                }
+                if (options.require_loop_or_call && !ts_has_loop_or_call(compound_statement_node)) {
+                    NODE_SKIP_CONTINUE("require-loop-or-call")
+                }
+
+                // 插入后--strip必须能按字节原样恢复，否则不插入
+                TextEdit insertion = make_trace_insertion(source_code, blank_start, insert_before_node, trace_line, options);
+                if (!trace_insertion_round_trips(source_code, insertion)) {
+                    PRINT_MSG_RED("insertion cannot be stripped back byte-for-byte, skipped: " << function_name)
+                    NODE_SKIP_CONTINUE("strip-round-trip")
+                }
+
+                // 按预算选择: 第一遍收集所有候选函数和权重，第二遍只插入被选中的函数
+                std::string candidate_key = function_name + "@" + std::to_string(ts_node_start_point(node).row + 1);
+                if (options.collect_candidates) {
+                    TraceCandidate candidate;
+                    candidate.function_name = function_name;
+                    candidate.line = ts_node_start_point(node).row + 1;
+                    measure_function_weight(compound_statement_node, source_code, get_short_name(function_name), get_enclosing_scopes(node, function_name, source_code), 0, candidate.weight);
+                    candidate.weight.finish();
+                    stats.candidates.push_back(candidate);
+                } else if (options.budget_selection != nullptr && options.budget_selection->count(candidate_key) == 0) {
+                    NODE_SKIP_CONTINUE("budget")
+                } else {
+                    PRINT_MSG_GREEN("function_name: "<<function_name)
+                }
+                stats.instrumented++;
+                if (uses_id) {
+                    // 只给确定插入的函数分配ID，跳过的函数不占用注册表、开关位和计数槽
+                    replace_all(insertion.text, "{Id}", std::to_string(options.registry->get_or_add(function_name, options.relative_path, ts_node_start_point(node).row + 1)));
+                    stats.id_scopes++;
+                }
 
-                trace_line += blank_chars;
-	            insertions.push_back({first_child_start, trace_line});
+#if InsertTraceToFunction
+                // 插入位置与前一个Node之间的空白字符复制一份，或者插入到同一行
+	            insertions.push_back(insertion);
 #endif
             }
         }
@@ -331,7 +3427,7 @@ void traverse_and_print(TSNode node, const std::string& source_code, std::vector
 
         // 如果节点有子节点，递归遍历
         if (ts_node_child_count(node) > 0) {
-            traverse_and_print(ts_node_named_child(node, 0), source_code, insertions,log_file,ignore_function_list);
+            traverse_and_print(ts_node_named_child(node, 0), source_code, insertions,log_file,ignore_function_list,options,stats);
         }
 
         // 获取下一个节点
@@ -339,6 +3435,38 @@ void traverse_and_print(TSNode node, const std::string& source_code, std::vector
     }
 }
 
+// Ctrl-C时设置，正在进行的解析会尽快返回，后面的文件不再处理
+// 信号处理函数里只能写无锁的原子变量；tree-sitter把它当作size_t原子读取，所以大小必须和size_t一样
+static std::atomic<size_t> parse_cancel_flag{0};
+static_assert(std::atomic<size_t>::is_always_lock_free && sizeof(std::atomic<size_t>) == sizeof(size_t), "parse_cancel_flag must be a lock-free size_t");
+
+void on_interrupt(int) {
+    parse_cancel_flag.store(1);
+    // 再按一次Ctrl-C直接退出
+    signal(SIGINT, SIG_DFL);
+}
+
+/**
+ * \brief 在大小限制内解析源代码，超时、取消或者超过大小时返回nullptr和原因
+ * 解析失败后重置解析器，下一个文件从头开始解析
+ */
+TSTree* parse_source_code(TSParser* parser, const std::string& source_code, size_t max_file_bytes, std::string& reason) {
+    if (parse_cancel_flag.load() != 0) {
+        reason = "cancelled";
+        return nullptr;
+    }
+    if (max_file_bytes > 0 && source_code.size() > max_file_bytes) {
+        reason = "size " + std::to_string(source_code.size()) + " bytes exceeds " + std::to_string(max_file_bytes);
+        return nullptr;
+    }
+    TSTree* tree = ts_parser_parse_string(parser, NULL, source_code.c_str(), static_cast<uint32_t>(source_code.size()));
+    if (tree == nullptr) {
+        reason = parse_cancel_flag.load() != 0 ? "cancelled" : "parse timeout";
+        ts_parser_reset(parser);
+    }
+    return tree;
+}
+
 
 
 int main(int argc, char* argv[]) {
@@ -351,14 +3479,243 @@ int main(int argc, char* argv[]) {
     std::string filename = exe_directory + "/log-" + buf;
     std::ofstream log_file(filename, std::ios_base::app);
 
-    if (argc != 2) {
-        std::cout << "Usage: " << argv[0] << " <directory>\n";
+    if (argc < 2) {
+        std::cout << "Usage: " << argv[0] << " <directory> [options]\n"
+                  << "  --restore [run]          restore the files modified by a run (default: latest)\n"
+                  << "  --force                  restore even files edited since they were instrumented\n"
+                  << "  --gc --keep <N>          keep the newest N runs and drop unreferenced backups\n"
+                  << "  --strip                  remove the inserted trace scopes\n"
+                  << "  --migrate                rewrite existing TRACE_CPUPROFILER_EVENT_SCOPE / SCOPE_CYCLE_COUNTER to the _WHEN_TRACING variant,\n"
+                  << "                           marked /*ATM*/ so --strip keeps them; functions containing them get no inserted scope\n"
+                  << "  --define <NAME[=VALUE]>  treat NAME as defined (default 1) and skip #if branches that cannot be compiled\n"
+                  << "  --undef <NAME>           treat NAME as not defined; macros neither defined nor undefined keep both branches\n"
+                  << "  --parse-timeout-ms <N>   skip files that take longer than N ms to parse, 0 = no limit (default 30000)\n"
+                  << "  --max-file-bytes <N>     skip files larger than N bytes, 0 = no limit (default 16 MiB)\n"
+                  << "  --kill-switch            insert AUTO_TRACE_SCOPE(name) from a generated header, AUTO_TRACE_ENABLED=0 compiles them out\n"
+                  << "  --macro-rules <file>     choose the inserted macro per path/class/function pattern (first match wins),\n"
+                  << "                           rule-inserted scopes always carry the marker so --strip can find them\n"
+                  << "  --marker                 insert with a marker / strip by marker without parsing\n"
+                  << "  --min-statements <N>     skip functions with fewer than N statements\n"
+                  << "  --min-body-bytes <N>     skip functions whose body is shorter than N bytes\n"
+                  << "  --require-loop-or-call   skip functions without any loop or call\n"
+                  << "  --skip-pure-return       skip functions whose body is a single return\n"
+                  << "  --pgo <csv>              prune functions using a timing export (name,count,incl,excl)\n"
+                  << "  --pgo-time-unit <s|ms|us> unit of the times in the csv (default s)\n"
+                  << "  --pgo-min-us <T>         prune functions averaging less than T us per call (default 1)\n"
+                  << "  --pgo-max-calls <N>      prune functions called more than N times per frame\n"
+                  << "  --pgo-frames <F>         number of frames in the capture (default 1)\n"
+                  << "  --pgo-keep-incl <P>      always keep functions with >= P% of the max inclusive time (default 1)\n"
+                  << "  --budget <N>             insert at most N scopes, highest static weight first\n"
+                  << "                           functions instrumented by earlier runs count against the budget;\n"
+                  << "                           loop, lambda and coroutine segment scopes are not counted and bypass it\n"
+                  << "  --budget-percent <X>     insert at most X% of the candidate functions\n"
+                  << "  --skip <rule>            enable a skip rule: forceinline, inline, noexcept, consteval,\n"
+                  << "                           nodiscard-accessor, anon-loop-callee (default on),\n"
+                  << "                           forcenoinline (default off),\n"
+                  << "                           loop-callee, single-caller, recursive (default off, use the per-file call graph)\n"
+                  << "  --loop-trip <N>          iterations assumed per loop when estimating saved events (default 10)\n"
+                  << "  --loop-min-bytes <N>     loops of functions with a 'file function loops[=N]' rule need at least N bytes (default 256)\n"
+                  << "  --coroutine-segments     in coroutines, scope blocks without co_await/co_yield/co_return (at least --loop-min-bytes)\n"
+                  << "  --lambdas                instrument lambdas passed to ParallelFor, AsyncTask, Async, Launch, CreateLambda, BindLambda, AddLambda\n"
+                  << "  --lambda-call <name>     instrument lambdas passed to calls of <name>, can be repeated\n"
+                  << "  --no-skip <rule>         disable a skip rule\n"
+                  << "  --after-guards           insert after leading early-return guards and check/ensure\n"
+                  << "  --same-line              insert on the line of the first statement, keeping line numbers unchanged\n"
+                  << "                           no #include is inserted, force-include the generated headers instead\n"
+                  << "  --id-registry [module]   insert AUTO_TRACE_SCOPE_ID(id) and generate a per-module function registry\n"
+                  << "  --enable-bits            with --id-registry, insert AUTO_TRACE_SCOPE_GATED(id) checking a runtime enable bit\n"
+                  << "  --counters               with --id-registry, insert AUTO_TRACE_COUNTER_SCOPE(id) accumulating calls/cycles\n"
+                  << "                           (compiled out by AUTO_TRACE_COUNTERS_ENABLED=0, independent of AUTO_TRACE_ENABLED)\n"
+                  << "                           (cannot be combined with --enable-bits)\n"
+                  << "  --outermost-recursive    insert AUTO_TRACE_SCOPE_OUTERMOST(id) into recursive functions, tracing only the outermost call\n"
+                  << "                           (direct self-calls and same-class cycles only; the cycle is logged per function)\n";
+        return 1;
+    }
+
+    // 解析命令行参数
+    bool restore = false;
+    bool force = false;
+    std::string restore_run_name;
+    bool gc = false;
+    size_t gc_keep = 10;
+    bool strip = false;
+    bool kill_switch = false;
+    bool use_defines = false;
+    uint64_t parse_timeout_ms = 30000;
+    size_t max_file_bytes = 16 * 1024 * 1024;
+    std::string macro_rules_file;
+    TraceOptions options;
+    std::string profile_csv;
+    ProfilePruneOptions prune_options;
+    bool use_registry = false;
+    bool enable_bits = false;
+    bool counters = false;
+    std::string module_name;
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--restore") {
+            restore = true;
+            if (i + 1 < argc && strncmp(argv[i + 1], "--", 2) != 0) {
+                restore_run_name = argv[++i];
+            }
+        } else if (arg == "--force") {
+            force = true;
+        } else if (arg == "--strip") {
+            strip = true;
+        } else if (arg == "--migrate") {
+            options.migrate = true;
+        } else if (arg == "--define" && i + 1 < argc) {
+            std::string define = argv[++i];
+            size_t equal = define.find('=');
+            options.defines[define.substr(0, equal)] = equal == std::string::npos ? "1" : define.substr(equal + 1);
+            use_defines = true;
+        } else if (arg == "--undef" && i + 1 < argc) {
+            options.undefs.insert(argv[++i]);
+            use_defines = true;
+        } else if (arg == "--parse-timeout-ms" && i + 1 < argc) {
+            parse_timeout_ms = strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--max-file-bytes" && i + 1 < argc) {
+            max_file_bytes = static_cast<size_t>(strtoull(argv[++i], nullptr, 10));
+        } else if (arg == "--kill-switch") {
+            kill_switch = true;
+            options.name_macro_name = trace_switch_macro_name;
+        } else if (arg == "--macro-rules" && i + 1 < argc) {
+            macro_rules_file = argv[++i];
+        } else if (arg == "--marker") {
+            options.insert_marker = true;
+        } else if (arg == "--min-statements" && i + 1 < argc) {
+            options.min_statements = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--min-body-bytes" && i + 1 < argc) {
+            options.min_body_bytes = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--require-loop-or-call") {
+            options.require_loop_or_call = true;
+        } else if (arg == "--skip-pure-return") {
+            options.skip_pure_return = true;
+        } else if (arg == "--id-registry") {
+            use_registry = true;
+            options.id_all = true;
+            if (i + 1 < argc && strncmp(argv[i + 1], "--", 2) != 0) {
+                module_name = argv[++i];
+            }
+        } else if (arg == "--enable-bits") {
+            enable_bits = true;
+            use_registry = true;
+            options.id_all = true;
+            options.id_macro_name = trace_gated_macro_name;
+        } else if (arg == "--counters") {
+            counters = true;
+            use_registry = true;
+            options.id_all = true;
+            options.id_macro_name = trace_counter_macro_name;
+        } else if (arg == "--outermost-recursive") {
+            use_registry = true;
+            options.outermost_recursive = true;
+        } else if (arg == "--same-line") {
+            options.same_line = true;
+        } else if (arg == "--after-guards") {
+            options.insert_after_guards = true;
+        } else if (arg == "--coroutine-segments") {
+            options.coroutine_segments = true;
+        } else if (arg == "--lambdas") {
+            options.lambda_calls.insert({"ParallelFor", "AsyncTask", "Async", "Launch", "CreateLambda", "BindLambda", "AddLambda", "CreateAndDispatchWhenReady"});
+        } else if (arg == "--lambda-call" && i + 1 < argc) {
+            options.lambda_calls.insert(argv[++i]);
+        } else if (arg == "--loop-min-bytes" && i + 1 < argc) {
+            options.loop_min_bytes = static_cast<uint32_t>(atoi(argv[++i]));
+        } else if (arg == "--loop-trip" && i + 1 < argc) {
+            options.loop_trip = atof(argv[++i]);
+        } else if (arg == "--skip" && i + 1 < argc) {
+            options.attribute_rules.insert(argv[++i]);
+        } else if (arg == "--no-skip" && i + 1 < argc) {
+            options.attribute_rules.erase(argv[++i]);
+        } else if (arg == "--budget" && i + 1 < argc) {
+            options.budget_count = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--budget-percent" && i + 1 < argc) {
+            options.budget_percent = std::strtod(argv[++i], nullptr);
+        } else if (arg == "--pgo" && i + 1 < argc) {
+            profile_csv = argv[++i];
+        } else if (arg == "--pgo-time-unit" && i + 1 < argc) {
+            std::string unit = argv[++i];
+            prune_options.time_unit_seconds = unit == "us" ? 1e-6 : (unit == "ms" ? 1e-3 : 1.0);
+        } else if (arg == "--pgo-min-us" && i + 1 < argc) {
+            prune_options.min_microseconds_per_call = std::strtod(argv[++i], nullptr);
+        } else if (arg == "--pgo-max-calls" && i + 1 < argc) {
+            prune_options.max_calls_per_frame = std::strtod(argv[++i], nullptr);
+        } else if (arg == "--pgo-frames" && i + 1 < argc) {
+            prune_options.frames = std::strtod(argv[++i], nullptr);
+        } else if (arg == "--pgo-keep-incl" && i + 1 < argc) {
+            prune_options.keep_inclusive_percent = std::strtod(argv[++i], nullptr);
+        } else if (arg == "--gc") {
+            gc = true;
+        } else if (arg == "--keep" && i + 1 < argc) {
+            gc_keep = std::strtoul(argv[++i], nullptr, 10);
+        } else {
+            std::cout << "Unknown option: " << arg << "\n";
+            return 1;
+        }
+    }
+
+    // 两个选项都决定按ID插入的宏，同时使用时其中一个会不起作用
+    if (enable_bits && counters) {
+        std::cout << "--enable-bits and --counters cannot be used together\n";
         return 1;
     }
 
+    // 备份仓库，同一个目录的所有运行共用，相同内容只保存一份
+    std::string source_directory = get_source_root(argv[1]);
+    std::string dir_name = std::filesystem::path(argv[1]).filename().string();
+    std::string store_directory = exe_directory + "/" + dir_name + "_bak";
+
+    if (restore) {
+        if (restore_run_name.empty() || restore_run_name == "latest") {
+            // 最新的一次实际修改过文件的运行，没有修改任何文件的运行恢复了也没有作用
+            std::vector<std::string> runs = store_list_runs(store_directory);
+            restore_run_name = "";
+            for (auto run_it = runs.rbegin(); run_it != runs.rend() && restore_run_name.empty(); ++run_it) {
+                for (const auto& entry : store_read_manifest(store_directory, *run_it)) {
+                    if (!entry.written_key.empty()) {
+                        restore_run_name = *run_it;
+                        break;
+                    }
+                }
+            }
+        }
+        return restore_run(store_directory, restore_run_name, source_directory, force);
+    }
+
+    if (gc) {
+        gc_store(store_directory, gc_keep);
+        return 0;
+    }
+
     // 读取忽略列表
     std::unordered_map<std::string, std::unordered_set<std::string>> ignore_list = read_ignore_list("./ignore_list.txt");
 
+    // 读取采样规则，采样的函数需要函数ID和生成的头文件
+    std::unordered_map<std::string, std::unordered_map<std::string, uint32_t>> sample_rules = read_function_rules("./ignore_list.txt", "sample", 2);
+    if (!sample_rules.empty()) {
+        use_registry = true;
+    }
+
+    // 读取宏规则，用到函数ID的规则需要注册表和生成的头文件，只有用到{Id}的规则匹配的函数按ID插入
+    std::vector<MacroRule> macro_rules;
+    if (!macro_rules_file.empty()) {
+        macro_rules = read_macro_rules(macro_rules_file, options.rule_macro_names);
+        options.macro_rules = &macro_rules;
+        for (const auto& rule : macro_rules) {
+            use_registry = use_registry || rule.macro_template.find("{Id}") != std::string::npos;
+        }
+        PRINT_MSG_GREEN("macro rules: " << macro_rules.size())
+    }
+
+    // 读取循环Trace规则: 文件名 函数名 loops[=最小循环字节数]
+    std::unordered_map<std::string, std::unordered_map<std::string, uint32_t>> loop_rules = read_function_rules("./ignore_list.txt", "loops", 0);
+
+    // 按性能数据裁剪，结果写回忽略列表
+    if (!profile_csv.empty()) {
+        prune_by_profile(profile_csv, prune_options, "./ignore_list.txt", ignore_list, log_file);
+    }
+
     // 获取当前日期
     auto now = std::chrono::system_clock::now();
     auto now_c = std::chrono::system_clock::to_time_t(now);
@@ -369,73 +3726,382 @@ int main(int argc, char* argv[]) {
     std::vector<std::string> cpp_files = find_cpp_files(argv[1]);
 
 #if InsertTraceToFunction
-    // 获取目录名
-    std::string dir_name = std::filesystem::path(argv[1]).filename().string();
+    std::string run_name = ss.str();
+    std::string run_mode = strip ? "strip" : "insert";
+
+    // 上次运行被中断时继续上次的运行
+    std::unordered_map<std::string, JournalFileState> journal_states;
+    std::string journal_run_name;
+    std::string journal_run_mode;
+    if (load_journal(store_directory, journal_run_name, journal_run_mode, journal_states)) {
+        if (journal_run_mode == run_mode) {
+            PRINT_MSG_GREEN("resume interrupted run " << journal_run_name)
+            run_name = journal_run_name;
+        } else {
+            // 模式不同不能继续，结束上次的运行，从当前状态重新开始
+            PRINT_MSG_RED("interrupted " << journal_run_mode << " run " << journal_run_name << " closed, starting a new run")
+            std::vector<BackupEntry> journal_entries;
+            for (const auto& state : journal_states) {
+                if (!state.second.backup_key.empty()) {
+                    journal_entries.push_back({state.second.backup_key, state.first, state.second.written_key});
+                }
+            }
+            std::sort(journal_entries.begin(), journal_entries.end(), [](const BackupEntry& a, const BackupEntry& b) {
+                return a.relative_path < b.relative_path;
+            });
+            store_write_manifest(store_directory, journal_run_name, journal_entries);
+            std::filesystem::remove(store_journal_path(store_directory));
+            journal_states.clear();
+        }
+    }
+
+    RunJournal journal;
+    bool new_journal = !std::filesystem::exists(store_journal_path(store_directory));
+    std::filesystem::create_directories(store_directory);
+    journal.open(store_journal_path(store_directory));
+    if (new_journal) {
+        journal.record("run", run_name, run_mode);
+    }
 
     // 备份 .cpp 文件
-    backup_files(cpp_files, argv[1],exe_directory + "/" + dir_name + "_bak_" + ss.str());
+    std::vector<BackupEntry> backup_entries;
+    if (!backup_files(cpp_files, source_directory, store_directory, run_name, journal, journal_states, backup_entries)) {
+        // 还没有修改任何文件，保留运行日志，下次运行继续备份
+        journal.close();
+        PRINT_MSG_RED("backup to " << store_directory << " failed, no file modified")
+        return 1;
+    }
+    std::unordered_map<std::string, size_t> backup_index;
+    for (size_t i = 0; i < backup_entries.size(); i++) {
+        backup_index[backup_entries[i].relative_path] = i;
+    }
 #endif
 
+    // 插入统计
+    TraceStats stats;
+
     // 创建一个解析器
     TSParser *parser = ts_parser_new();
 
     // 设置解析器的语言
     ts_parser_set_language(parser, tree_sitter_cpp());
 
+    // 每个文件的解析时间限制，Ctrl-C取消正在进行的解析
+    ts_parser_set_timeout_micros(parser, parse_timeout_ms * 1000);
+    ts_parser_set_cancellation_flag(parser, reinterpret_cast<const size_t*>(&parse_cancel_flag));
+    signal(SIGINT, on_interrupt);
+
+    // 跳过的文件和原因
+    std::vector<std::pair<std::string, std::string>> skipped_files;
+
+    // 按预算选择时，先扫描所有文件计算候选函数的权重，在修改任何文件之前选出要插入的函数
+    std::unordered_map<std::string, std::unordered_set<std::string>> budget_selection;
+    bool use_budget = !strip && (options.budget_count > 0 || options.budget_percent > 0.0);
+    if (use_budget) {
+        TraceOptions scan_options = options;
+        scan_options.collect_candidates = true;
+        TraceStats scan_stats;
+        for (const auto& file_path : cpp_files) {
+            if (parse_cancel_flag.load() != 0) {
+                break;
+            }
+            std::string source_code;
+            if (!read_file_bytes(file_path, source_code)) {
+                continue;
+            }
+            std::string skip_reason;
+            TSTree *tree = parse_source_code(parser, source_code, max_file_bytes, skip_reason);
+            if (tree == nullptr) {
+                // 没有参加预算排名的文件不会插入
+                PRINT_MSG_RED("budget scan skipped " << file_path << ": " << skip_reason)
+                skipped_files.push_back({file_path, "budget scan: " + skip_reason});
+                continue;
+            }
+
+            std::unordered_set<std::string> ignore_function_list = get_ignore_function_list(ignore_list, file_path);
+            std::vector<TextEdit> edits;
+            size_t first_candidate = scan_stats.candidates.size();
+            CallGraph call_graph;
+            build_call_graph(ts_tree_root_node(tree), source_code, ignore_function_list, call_graph);
+            scan_options.call_graph = &call_graph;
+            std::vector<std::pair<uint32_t, uint32_t>> inactive_ranges;
+            if (use_defines) {
+                collect_inactive_ranges(ts_tree_root_node(tree), source_code, scan_options, inactive_ranges);
+                scan_options.inactive_ranges = &inactive_ranges;
+            }
+            // 宏规则按路径匹配，排名时和插入时要排除同样的函数
+            std::string relative_path = std::filesystem::relative(file_path, source_directory).generic_string();
+            scan_options.relative_path = relative_path;
+            traverse_and_print(ts_tree_root_node(tree), source_code, edits,log_file,ignore_function_list,scan_options,scan_stats);
+            for (size_t i = first_candidate; i < scan_stats.candidates.size(); i++) {
+                scan_stats.candidates[i].file = relative_path;
+            }
+
+            ts_tree_delete(tree);
+        }
+        std::string ranking_filename = exe_directory + "/" + dir_name + "_ranking.csv";
+        budget_selection = select_by_budget(scan_stats.candidates, scan_stats.existing_scopes, options, ranking_filename);
+        PRINT_MSG_GREEN("budget: " << scan_stats.candidates.size() << " candidates, " << scan_stats.existing_scopes << " already instrumented, ranking written to " << ranking_filename)
+    }
+    std::unordered_set<std::string> empty_selection;
+
+    // 按函数ID插入时读取注册表，已分配的ID保持不变
+    FunctionRegistry registry;
+    size_t registry_written_size = 0;
+    std::string registry_path = (std::filesystem::path(source_directory) / registry_file_name).string();
+    if (use_registry && !strip) {
+        registry = read_function_registry(registry_path);
+        options.registry = &registry;
+        registry_written_size = registry.entries.size();
+        if (module_name.empty()) {
+            module_name = dir_name;
+        }
+    }
+
+    // --same-line不能插入#include行，生成的头文件需要强制包含
+    if (options.same_line && !strip && (use_registry || kill_switch)) {
+        std::filesystem::path header_directory = std::filesystem::absolute(source_directory);
+        PRINT_MSG_RED("--same-line does not insert #include lines, force-include the generated headers (/FI or ForceIncludeFiles):")
+        if (use_registry) {
+            PRINT_MSG_RED("  " << (header_directory / generated_header_name).generic_string())
+        }
+        if (kill_switch) {
+            PRINT_MSG_RED("  " << (header_directory / generated_switch_header_name).generic_string())
+        }
+    }
+
     // 遍历并处理所有的 .cpp 文件
     for (const auto& file_path : cpp_files) {
+        // Ctrl-C后不再处理后面的文件，已经写入的文件都是完整的
+        if (parse_cancel_flag.load() != 0) {
+            break;
+        }
         PRINT_MSG(file_path)
 
         // 解析源代码
-        std::ifstream file(file_path);
-        if (!file) {
+        std::string source_code;
+        if (!read_file_bytes(file_path, source_code)) {
             continue;
         }
-        std::string source_code((std::istreambuf_iterator<char>(file)),
-                                std::istreambuf_iterator<char>());
-        file.close();
-        TSTree *tree = ts_parser_parse_string(parser, NULL, source_code.c_str(), source_code.size());
 
-        // 获取抽象语法树的根节点
-        TSNode root_node = ts_tree_root_node(tree);
+#if InsertTraceToFunction
+        std::string relative_path = std::filesystem::relative(file_path, source_directory).generic_string();
+        auto backup_it = backup_index.find(relative_path);
+        auto state_it = journal_states.find(relative_path);
+        if (state_it != journal_states.end()) {
+            const JournalFileState& state = state_it->second;
+            std::string current_key = store_object_key(source_code);
+
+            // 上次运行已经处理完的文件
+            if (!state.written_key.empty() || state.parsed_without_edits) {
+                continue;
+            }
 
-        // 是否包含忽略
-        std::unordered_set<std::string> ignore_function_list;
-        std::string cpp_filename = std::filesystem::path(file_path).filename().string();
-        if(ignore_list.count(cpp_filename)>0)
-        {
-        	ignore_function_list=ignore_list[cpp_filename];
+            // 覆盖文件后还没来得及记录written就被中断了
+            if (!state.begin_key.empty() && current_key == state.begin_key) {
+                journal.record("written", relative_path, current_key);
+                if (backup_it != backup_index.end()) {
+                    backup_entries[backup_it->second].written_key = current_key;
+                }
+                continue;
+            }
+
+            std::filesystem::remove(file_path + ".tmp");
+            if (!state.backup_key.empty() && current_key != state.backup_key) {
+                // 覆盖文件是先写临时文件再改名，中断后只会是原始内容或修改后的内容
+                // 两者都不是说明用户在中断后修改了文件，保留用户的内容并重新备份
+                std::string key = store_put_object(store_directory, source_code);
+                if (key.empty()) {
+                    PRINT_MSG_RED("backup failed, skipped: " << relative_path)
+                    skipped_files.push_back({file_path, "backup failed"});
+                    continue;
+                }
+                journal.record("backup", relative_path, key);
+                if (backup_it != backup_index.end()) {
+                    backup_entries[backup_it->second].key = key;
+                }
+                PRINT_MSG_GREEN("file changed since interrupted run, backed up again: " << relative_path)
+            }
         }
+#endif
+
+        std::vector<TextEdit> edits;
+        if (strip) {
+            // 没有Trace宏的文件不需要解析
+            bool has_trace = false;
+            for (const auto& macro_name : auto_trace_macro_names) {
+                has_trace = has_trace || source_code.find(macro_name) != std::string::npos;
+            }
+            // 宏规则插入的Trace只有标记
+            has_trace = has_trace || source_code.find(trace_marker) != std::string::npos;
+            if (!has_trace) {
+                continue;
+            }
+
+            if (options.insert_marker) {
+                // 按标记去除，不需要解析
+                strip_marked_traces(source_code, edits);
+            } else {
+                std::string skip_reason;
+                TSTree *tree = parse_source_code(parser, source_code, max_file_bytes, skip_reason);
+                if (tree == nullptr) {
+                    PRINT_MSG_RED("skipped " << file_path << ": " << skip_reason)
+                    skipped_files.push_back({file_path, skip_reason});
+                    continue;
+                }
+                strip_traverse(ts_tree_root_node(tree), source_code, edits);
+                ts_tree_delete(tree);
+            }
+            strip_generated_include(source_code, edits);
+        } else {
+            std::string skip_reason;
+            TSTree *tree = parse_source_code(parser, source_code, max_file_bytes, skip_reason);
+            if (tree == nullptr) {
+                PRINT_MSG_RED("skipped " << file_path << ": " << skip_reason)
+                skipped_files.push_back({file_path, skip_reason});
+                continue;
+            }
 
+            // 获取抽象语法树的根节点
+            TSNode root_node = ts_tree_root_node(tree);
 
-        // 遍历抽象语法树并记录需要插入的字符串和位置
-        std::vector<std::pair<size_t, std::string>> insertions;
-        traverse_and_print(root_node, source_code, insertions,log_file,ignore_function_list);
+            // 是否包含忽略
+            std::unordered_set<std::string> ignore_function_list = get_ignore_function_list(ignore_list, file_path);
 
-#if WriteInsertTrace
-        // 按照位置从大到小的顺序插入字符串，这样不会影响到其他插入位置的正确性
-        std::sort(insertions.begin(), insertions.end(), [](const std::pair<size_t, std::string>& a, const std::pair<size_t, std::string>& b) {
-            return a.first > b.first;
-        });
+            // 当前文件中被预算选中的函数
+            if (use_budget) {
+                auto selection_it = budget_selection.find(std::filesystem::relative(file_path, source_directory).generic_string());
+                options.budget_selection = selection_it != budget_selection.end() ? &selection_it->second : &empty_selection;
+            }
+
+            // 当前文件中按宏定义不会编译的范围
+            std::vector<std::pair<uint32_t, uint32_t>> inactive_ranges;
+            if (use_defines) {
+                collect_inactive_ranges(root_node, source_code, options, inactive_ranges);
+                options.inactive_ranges = &inactive_ranges;
+            }
+
+            // 当前文件的调用关系
+            CallGraph call_graph;
+            build_call_graph(root_node, source_code, ignore_function_list, call_graph);
+            options.call_graph = &call_graph;
+
+            // 当前文件中按1/N采样的函数
+            std::unordered_map<std::string, uint32_t> sample_function_list = get_function_rule_list(sample_rules, file_path);
+            options.sample_functions = &sample_function_list;
+
+            // 当前文件中需要给循环插入Trace的函数
+            std::unordered_map<std::string, uint32_t> loop_function_list = get_function_rule_list(loop_rules, file_path);
+            options.loop_functions = &loop_function_list;
+
+            // 遍历抽象语法树并记录需要插入的字符串和位置
+            options.relative_path = std::filesystem::relative(file_path, source_directory).generic_string();
+            size_t id_scopes_before = stats.id_scopes;
+            traverse_and_print(root_node, source_code, edits,log_file,ignore_function_list,options,stats);
+
+            // 已有的Trace/Stat改成_WHEN_TRACING版本
+            if (options.migrate) {
+                migrate_traverse(root_node, source_code, edits, log_file, stats);
+            }
+
+            // 按函数ID插入的文件需要包含生成的头文件，--same-line插入#include会改变行号，由编译选项强制包含
+            if (options.registry != nullptr && stats.id_scopes > id_scopes_before && !options.same_line) {
+                add_generated_include(root_node, source_code, file_path, source_directory, generated_header_name, edits);
+            }
+
+            // 插入了开关宏的文件需要包含开关宏的头文件
+            if (kill_switch && edits_insert_macro(edits, trace_switch_macro_name) && !options.same_line) {
+                add_generated_include(root_node, source_code, file_path, source_directory, generated_switch_header_name, edits);
+            }
 
-        for (const auto& insertion : insertions) {
-            source_code.insert(insertion.first, insertion.second);
+            // 删除抽象语法树
+            ts_tree_delete(tree);
         }
 
+#if InsertTraceToFunction
+        journal.record("parsed", relative_path, std::to_string(edits.size()));
+#endif
+
+#if WriteInsertTrace
+        apply_text_edits(source_code, edits);
+
+        // 没有修改的文件不重写，避免触发重新编译
+        if (!edits.empty()) {
+            // 分配了新ID时先写入注册表再修改文件，中断后继续时已经写入文件的ID不会被重新分配
+            if (options.registry != nullptr && registry.entries.size() != registry_written_size) {
+                if (!write_function_registry(registry_path, registry)) {
+                    PRINT_MSG_RED("write failed: " << registry_path)
+                    skipped_files.push_back({file_path, "registry write failed"});
+                    continue;
+                }
+                registry_written_size = registry.entries.size();
+#if InsertTraceToFunction
+                journal.record("registry", relative_path, std::to_string(registry_written_size));
+#endif
+            }
 
-        // 覆盖原始文件
-        std::ofstream out_file(file_path);
-        out_file << source_code;
-        out_file.close();
+#if InsertTraceToFunction
+            // 先记录再覆盖，中断后可以判断文件是否已经写入
+            std::string written_key = store_object_key(source_code);
+            journal.record("begin", relative_path, written_key);
 #endif
 
-        // 删除抽象语法树
-        ts_tree_delete(tree);
+            // 覆盖原始文件，写入失败的文件不记录written，继续时会重新处理
+            if (!write_file_bytes(file_path, source_code)) {
+                PRINT_MSG_RED("write failed: " << file_path)
+                skipped_files.push_back({file_path, "write failed"});
+                continue;
+            }
+
+#if InsertTraceToFunction
+            // 记录插入后的内容，恢复时用来确认文件没有被用户再次修改
+            journal.record("written", relative_path, written_key);
+            if (backup_it != backup_index.end()) {
+                backup_entries[backup_it->second].written_key = written_key;
+            }
+#endif
+        }
+#endif
     }
 
     // 删除解析器
     ts_parser_delete(parser);
 
+    if (!strip) {
+        print_trace_stats(stats, log_file);
+    }
+
+    // 没有处理的文件和原因
+    for (const auto& skipped_file : skipped_files) {
+        PRINT_MSG_RED("skipped file: " << skipped_file.first << " (" << skipped_file.second << ")")
+    }
+
+    // 写入开关宏的头文件
+    if (kill_switch && !strip) {
+        write_switch_header(source_directory);
+        PRINT_MSG_GREEN("generated " << generated_switch_header_name)
+    }
+
+    // 写入注册表和生成的文件
+    if (options.registry != nullptr) {
+        write_function_registry(registry_path, registry);
+        write_generated_files(source_directory, module_name, registry);
+        PRINT_MSG_GREEN("function registry: " << registry.entries.size() << " functions, generated " << generated_header_name << " / " << generated_source_name)
+    }
+
+#if InsertTraceToFunction
+    if (parse_cancel_flag.load() != 0) {
+        // 保留运行日志，下次同样的运行继续处理剩下的文件
+        journal.close();
+        PRINT_MSG_RED("cancelled, run again to resume " << run_name)
+    } else {
+        // 更新本次运行的清单，运行完成后删除运行日志
+        store_write_manifest(store_directory, run_name, backup_entries);
+        journal.close();
+        std::filesystem::remove(store_journal_path(store_directory));
+    }
+#endif
+
     std::cout << "Done!\n";
 
     system("pause");